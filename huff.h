@@ -0,0 +1,148 @@
+/* huff.h
+ * libhuff: in-memory Huffman compression into caller-provided buffers.
+ * Compressed buffers use the HUF3 block format written by the huff tool
+ * (see huffman.c), so either side can read what the other wrote.
+ *
+ * Nothing in the library prints or exits; every failure comes back as a
+ * negative HUF_ERR_* code. A context may only be used by one thread at a
+ * time, but separate contexts can be used concurrently.
+ *
+ * Build: cc -O2 -pthread -c libhuff.c
+ */
+
+#ifndef HUFF_H
+#define HUFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Status codes, returned by the library and by its internal routines */
+enum {
+    HUF_OK = 0,
+    HUF_ERR_TRUNCATED = -1,  /* encoded data ends early */
+    HUF_ERR_CORRUPT = -2,    /* encoded data is malformed */
+    HUF_ERR_FORMAT = -3,     /* not a HUF2/HUF3 buffer */
+    HUF_ERR_DST_SIZE = -4,   /* destination buffer too small */
+    HUF_ERR_PARAM = -5,      /* parameter out of range */
+    HUF_ERR_MEMORY = -6,     /* allocation failed */
+    HUF_ERR_DICTIONARY = -7, /* dictionary-coded data, wrong or no dictionary */
+    HUF_ERR_CHECKSUM = -8    /* a block does not match its checksum */
+};
+
+typedef struct {
+    size_t block_size;   /* bytes per independently coded block, 1K..256M */
+    int max_code_len;    /* longest code the encoder may emit, 8..32 */
+    int streams;         /* bitstreams per block: 1, or 4 interleaved */
+    int checksum;        /* 1: store a CRC32C with every block */
+    int order1;          /* 1: code a block with tables chosen by the
+                            previous byte when that comes out smaller */
+    int transforms;      /* HUFF_TRANSFORM_* passes the encoder may try */
+    int adaptive;        /* 1: cut a block in smaller ones, each with its
+                            own table, where the byte statistics shift */
+} HuffParams;
+
+/* Pre-passes ahead of the Huffman coder, each kept for a block only if it
+   makes the block smaller */
+#define HUFF_TRANSFORM_RLE  0x01  /* runs of four or more bytes become counts */
+#define HUFF_TRANSFORM_LZ77 0x02  /* repeats become back-references */
+
+typedef struct HuffCCtx HuffCCtx;
+typedef struct HuffDCtx HuffDCtx;
+typedef struct HuffDict HuffDict;
+
+/* Defaults: 1M blocks, 11-bit codes, 4 streams, no checksums, order-0,
+   no transforms, fixed-size blocks */
+void huff_params_default(HuffParams *params);
+
+/* HUF_OK, or HUF_ERR_PARAM if any field is out of range */
+int huff_params_check(const HuffParams *params);
+
+/* Largest compressed size of src_len bytes; params may be NULL for the
+   defaults. Returns 0 if params fail huff_params_check. */
+size_t huff_compress_bound(size_t src_len, const HuffParams *params);
+
+/* A compression context keeps its parameters and a scratch block that is
+   allocated on first use. Returns NULL if params (NULL for the defaults)
+   are invalid or memory runs out. */
+HuffCCtx *huff_cctx_create(const HuffParams *params);
+void huff_cctx_free(HuffCCtx *cctx);
+
+/* Compress src[0..src_len) into dst and store the compressed size in
+   *dst_len. With dst_cap >= huff_compress_bound() this never allocates,
+   except for the order-1 statistics, transform buffers and split plan of
+   each block when params->order1, params->transforms or params->adaptive
+   is set; a smaller dst works as long as the output fits, else
+   HUF_ERR_DST_SIZE. */
+int huff_compress_ctx(HuffCCtx *cctx, const void *src, size_t src_len,
+                      void *dst, size_t dst_cap, size_t *dst_len);
+
+/* One-shot huff_compress_ctx with default parameters */
+int huff_compress(const void *src, size_t src_len, void *dst, size_t dst_cap, size_t *dst_len);
+
+/* A decompression context keeps the decode tables between calls, so
+   repeated calls stop allocating once the largest table has been seen. */
+HuffDCtx *huff_dctx_create(void);
+void huff_dctx_free(HuffDCtx *dctx);
+
+/* Original size recorded in a complete HUF2/HUF3 buffer or in a
+   dictionary-coded message; for concatenated HUF3 files, their sum */
+int huff_decompressed_size(const void *src, size_t src_len, uint64_t *size);
+
+/* Decompress a complete HUF2/HUF3 buffer into dst and store the original
+   size in *dst_len. Blocks that carry a checksum are checked against it.
+   HUF3 files joined back to back decode to their data joined, and so do
+   the parts of one that huff -c --append extended. HUF1 files are only
+   readable by the huff tool. */
+int huff_decompress_ctx(HuffDCtx *dctx, const void *src, size_t src_len,
+                        void *dst, size_t dst_cap, size_t *dst_len);
+
+/* One-shot huff_decompress_ctx; allocates its decode tables per call */
+int huff_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap, size_t *dst_len);
+
+/* Decode bytes [offset, offset + len) of the original data of a complete
+   HUF3 buffer into dst, decoding only the blocks that cover them. Stops
+   early at the end of the data: *dst_len says how much was written.
+   HUF_ERR_PARAM if offset is past the end, HUF_ERR_FORMAT for HUF2. Joined
+   HUF3 files have no single index and come back HUF_ERR_CORRUPT. */
+int huff_decompress_range(HuffDCtx *dctx, const void *src, size_t src_len, uint64_t offset,
+                          void *dst, size_t len, size_t *dst_len);
+
+/* Dictionaries: a code table trained once on sample data and shared by
+   both sides, for inputs too small to carry their own table. Messages
+   coded with one store just its ID and their size in front of the bits,
+   so there is no counting pass and no table or index in the output. */
+
+/* Largest serialized dictionary */
+#define HUFF_DICT_MAX_SIZE (8 + 2 + 2 * 256)
+
+/* Train a dictionary on samples[0..samples_len) (all samples back to back)
+   and serialize it into dict. Bytes that never occur in the samples still
+   get a code. max_code_len 0 means the default. */
+int huff_dict_train(const void *samples, size_t samples_len, int max_code_len,
+                    void *dict, size_t dict_cap, size_t *dict_len);
+
+/* Load a serialized dictionary; NULL if it is malformed or memory runs
+   out. A loaded dictionary is read-only and may be shared by threads. */
+HuffDict *huff_dict_create(const void *dict, size_t dict_len);
+void huff_dict_free(HuffDict *dict);
+uint32_t huff_dict_id(const HuffDict *dict);
+
+/* ID of the dictionary a message was coded with; HUF_ERR_FORMAT if the
+   buffer is not dictionary-coded */
+int huff_get_dict_id(const void *src, size_t src_len, uint32_t *id);
+
+size_t huff_dict_compress_bound(const HuffDict *dict, size_t src_len);
+
+/* Like huff_compress_ctx, against a dictionary; never allocates */
+int huff_compress_dict(const HuffDict *dict, const void *src, size_t src_len,
+                       void *dst, size_t dst_cap, size_t *dst_len);
+
+/* Decode a message from huff_compress_dict; HUF_ERR_DICTIONARY if it was
+   coded with a different dictionary */
+int huff_decompress_dict(const HuffDict *dict, const void *src, size_t src_len,
+                         void *dst, size_t dst_cap, size_t *dst_len);
+
+/* Message for a status code */
+const char *huff_error_string(int err);
+
+#endif /* HUFF_H */
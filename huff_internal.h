@@ -0,0 +1,405 @@
+/* huff_internal.h
+ * The parts of libhuff that the huff tool builds on: bit I/O, code tables,
+ * decode tables and the HUF3 block layout described in huffman.c. Not part
+ * of the public API; exported internals use the huf_ prefix, the public API
+ * in huff.h uses huff_.
+ */
+
+#ifndef HUFF_INTERNAL_H
+#define HUFF_INTERNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "huff.h"
+
+/* -------------------- Byte Order -------------------- */
+
+static inline void store_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint64_t load_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = (uint8_t)(v >> (56 - 8 * i));
+}
+
+static inline uint64_t load_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+/* -------------------- Bit I/O -------------------- */
+
+/* Both directions keep up to 64 pending bits in a word-wide accumulator
+   (MSB-first, matching the on-disk bit order) and move whole 8-byte words
+   between it and a block buffer. The writer only fills memory: whoever
+   streams to a file empties buf and resets pos between chunks. */
+#define BIT_IO_BUF_SIZE (1 << 16)
+
+typedef struct {
+    uint64_t acc;    /* pending bits, MSB-aligned */
+    int bits;        /* number of pending bits in acc [0..64] */
+    uint8_t *buf;    /* output buffer */
+    size_t pos;      /* bytes used in buf */
+    size_t cap;      /* size of buf */
+} BitWriter;
+
+/* Write into dst, which the caller sized for the worst case; after
+   bw_flush, bw->pos is the number of bytes produced. */
+static inline void bw_init_mem(BitWriter *bw, uint8_t *dst, size_t cap) {
+    bw->acc = 0;
+    bw->bits = 0;
+    bw->buf = dst;
+    bw->pos = 0;
+    bw->cap = cap;
+}
+
+static inline void bw_put_word(BitWriter *bw, uint64_t w) {
+    store_be64(bw->buf + bw->pos, w);
+    bw->pos += 8;
+}
+
+/* Append the low len bits of code (len 1..32), most significant first */
+static inline void bw_write_bits(BitWriter *bw, uint32_t code, int len) {
+    uint64_t c = code;
+    if (bw->bits + len > 64) {
+        int room = 64 - bw->bits;
+        len -= room;
+        bw_put_word(bw, bw->acc | (c >> len));
+        c &= ((uint64_t)1 << len) - 1u;
+        bw->acc = 0;
+        bw->bits = 0;
+    }
+    bw->acc |= c << (64 - bw->bits - len);
+    bw->bits += len;
+}
+
+static inline void bw_flush(BitWriter *bw) {
+    /* pending bits go out as whole bytes, padded with zeros in the LSBs */
+    while (bw->bits > 0) {
+        bw->buf[bw->pos++] = (uint8_t)(bw->acc >> 56);
+        bw->acc <<= 8;
+        bw->bits = bw->bits > 8 ? bw->bits - 8 : 0;
+    }
+    bw->acc = 0;
+}
+
+typedef struct {
+    FILE *f;         /* NULL when reading from a memory buffer */
+    uint64_t acc;    /* unread bits, MSB-aligned */
+    int bits;        /* number of valid bits in acc [0..64] */
+    uint8_t *buf;    /* input block buffer */
+    size_t pos;      /* next unread byte in buf */
+    size_t len;      /* bytes available in buf */
+    int eof;
+} BitReader;
+
+/* Read from f through buf, which must hold BIT_IO_BUF_SIZE bytes */
+static inline void br_init(BitReader *br, FILE *f, uint8_t *buf) {
+    br->f = f;
+    br->acc = 0;
+    br->bits = 0;
+    br->buf = buf;
+    br->pos = 0;
+    br->len = 0;
+    br->eof = 0;
+}
+
+/* Read straight from src; the buffer is never written in this mode. */
+static inline void br_init_mem(BitReader *br, const uint8_t *src, size_t len) {
+    br->f = NULL;
+    br->acc = 0;
+    br->bits = 0;
+    br->buf = (uint8_t*)src;
+    br->pos = 0;
+    br->len = len;
+    br->eof = 1;
+}
+
+/* -------------------- Huffman Codes -------------------- */
+
+/* Non-linear structure: Huffman Tree Node */
+typedef struct Node {
+    uint32_t freq;
+    int is_leaf;
+    uint16_t symbol;       /* 0..255 if leaf */
+    struct Node *left;
+    struct Node *right;
+} Node;
+
+/* Code table: for each byte, a (code, length) pair */
+typedef struct {
+    uint32_t code;
+    uint8_t  len;
+} Code;
+
+#define MAX_CODE_LEN 32  /* Code.code is a uint32_t */
+#define DEFAULT_MAX_CODE_LEN 11  /* every code resolves in the root decode table */
+#define MIN_MAX_CODE_LEN     8   /* 256 symbols need at least 8 bits */
+
+/* Add the byte counts of src[0..n) to freq */
+void huf_histogram(const uint8_t *src, size_t n, uint32_t freq[256]);
+
+/* CRC32C of src[0..n), in hardware where the CPU has it */
+uint32_t huf_crc32c(const uint8_t *src, size_t n);
+
+/* Extend the CRC32C crc of earlier bytes with src[0..n) */
+uint32_t huf_crc32c_update(uint32_t crc, const uint8_t *src, size_t n);
+
+/* Canonical code table for freq with no code longer than max_len bits. The
+   counts must total less than 2^32, as the tree's weights are uint32_t. */
+void huf_build_code_table(const uint32_t freq[256], Code table[256], int max_len);
+
+/* Scale 64-bit byte counts to freq so they total less than 2^32; a byte
+   that occurs keeps a nonzero count and ratios are kept to ~31 bits */
+void huf_normalize_counts(const uint64_t counts[256], uint32_t freq[256]);
+
+/* Canonical codes for lens, which must have passed huf_code_lengths_valid
+   (or come from the encoder): no length may exceed MAX_CODE_LEN */
+void huf_assign_canonical_codes(const uint8_t lens[256], Code table[256]);
+int huf_code_lengths_valid(const uint8_t lens[256]);
+
+/* -------------------- Code Length Table -------------------- */
+
+enum { CL_NONE = 0, CL_SPARSE = 1, CL_PACKED = 2 };
+
+#define CODE_LENGTHS_MAX_BYTES (2 + 2 * 256)
+
+size_t huf_pack_code_lengths(const uint8_t lens[256], uint8_t *dst);
+size_t huf_code_lengths_size(const uint8_t *src, size_t have);
+size_t huf_unpack_code_lengths(const uint8_t *src, size_t avail, uint8_t lens[256]);
+
+/* -------------------- Decode Table -------------------- */
+
+/* Two-level lookup table: the root is indexed by the next root_bits bits of
+   input; codes longer than that go through a link entry to a subtable that
+   is indexed by the following bits. */
+#define DECODE_ROOT_BITS 11
+
+enum { DE_INVALID = 0, DE_SYMBOL, DE_LINK };
+
+typedef struct {
+    uint32_t value;  /* symbol, or index of the first subtable entry */
+    uint8_t  len;    /* symbol: full code length; link: subtable index bits */
+    uint8_t  kind;
+} DecodeEntry;
+
+/* Multi-symbol entry, indexed like the root table: up to MULTI_MAX_SYMS
+   whole codes that fit in the root_bits window, packed as
+   sym0 | sym1 << 8 | sym2 << 16 | bits << 24 | count << 29.
+   count 0 means the first code is longer than the window. */
+#define MULTI_MAX_SYMS 3
+
+/* Storage is kept across builds, so one table can serve many blocks */
+typedef struct DecodeTable {
+    DecodeEntry *entries;  /* root table followed by all subtables */
+    size_t cap;            /* entries allocated */
+    uint32_t *multi;       /* multi-symbol table, or NULL */
+    uint32_t *multi_buf;   /* storage behind multi */
+    int root_bits;
+    struct DecodeTable *order1;  /* ORDER1_MAX_TABLES tables for order-1
+                                    blocks, allocated by the first one */
+    uint8_t *work[2];      /* transform buffers: RLE4 input, LZ77 codes */
+    size_t work_cap[2];
+    int fixed;             /* storage reserved up front: never allocate */
+} DecodeTable;
+
+void huf_decode_table_init(DecodeTable *dt);
+int huf_decode_table_build(DecodeTable *dt, const Code table[256], int multi);
+void huf_decode_table_free(DecodeTable *dt);
+
+/* Bounded decoding gives every table this many entries, which covers any
+   code of up to DECODE_ROOT_BITS bits and most longer ones */
+#define DECODE_FIXED_ENTRIES (2u << DECODE_ROOT_BITS)
+
+/* What huf_decode_table_reserve sets aside beyond the order-0 table */
+#define RESERVE_ORDER1     0x01  /* the tables of order-1 blocks */
+#define RESERVE_TRANSFORMS 0x02  /* RLE4 and LZ77 buffers for blocks of up to block_size */
+
+/* Give dt all of its storage from arena, 16-byte aligned, and return the
+   bytes used; with dt NULL only count them. Afterwards dt never allocates:
+   a table over DECODE_FIXED_ENTRIES entries, or a block that needs what
+   was not reserved, fails with HUF_ERR_MEMORY. The caller owns the arena,
+   and huf_decode_table_free leaves it alone. */
+size_t huf_decode_table_reserve(DecodeTable *dt, uint8_t *arena, size_t block_size, int what);
+
+/* Decode exactly n symbols, several per lookup when dt has a multi table */
+int huf_decode_run(const DecodeTable *dt, BitReader *br, uint8_t *dst, size_t n);
+
+/* -------------------- Block Container -------------------- */
+
+static const uint8_t MAGIC_V2[4]       = { 'H', 'U', 'F', '2' };
+static const uint8_t MAGIC_V3[4]       = { 'H', 'U', 'F', '3' };
+static const uint8_t MAGIC_TRAILER[4]  = { 'H', 'U', 'F', 'X' };
+static const uint8_t MAGIC_DICT[4]     = { 'H', 'U', 'F', 'T' };
+static const uint8_t MAGIC_DICT_MSG[4] = { 'H', 'U', 'F', 'D' };
+
+#define FILE_HEADER_SIZE   8
+#define BLOCK_HEADER_SIZE  10
+#define INDEX_ENTRY_SIZE   16
+#define TRAILER_SIZE       20
+
+#define DEFAULT_BLOCK_SIZE   (1u << 20)
+#define MIN_BLOCK_SIZE       (1u << 10)
+#define MAX_BLOCK_SIZE       (1u << 28)
+
+enum { BT_INDEX = 0, BT_HUFFMAN = 1, BT_RAW = 2, BT_RLE = 3, BT_ORDER1 = 4, BT_LZ77 = 5, BT_COUNT };
+
+#define BF_STREAMS4 0x01   /* payload holds four interleaved bitstreams */
+#define BF_CRC32C   0x02   /* payload ends with the CRC32C of the original bytes */
+#define BF_RLE4     0x04   /* payload codes the RLE4 form of the block */
+#define BF_KNOWN    (BF_STREAMS4 | BF_CRC32C | BF_RLE4)
+
+#define BLOCK_CHECKSUM_SIZE 4
+
+/* Blocks smaller than this are not worth the 12-byte stream jump table */
+#define MIN_STREAMS4_SIZE 256
+
+/* Order-1 blocks code each byte with the table its predecessor's context
+   maps to; the 256 contexts share at most this many tables */
+#define ORDER1_MAX_TABLES 8
+
+/* Smaller blocks never pay for an order-1 map and several tables */
+#define ORDER1_MIN_SIZE 4096
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint32_t original_size;  /* BT_INDEX: block count */
+    uint32_t payload_size;   /* BT_INDEX: entry bytes */
+} BlockHeader;
+
+static inline void store_block_header(uint8_t *p, const BlockHeader *h) {
+    p[0] = h->type;
+    p[1] = h->flags;
+    store_le32(p + 2, h->original_size);
+    store_le32(p + 6, h->payload_size);
+}
+
+static inline void load_block_header(const uint8_t *p, BlockHeader *h) {
+    h->type = p[0];
+    h->flags = p[1];
+    h->original_size = load_le32(p + 2);
+    h->payload_size = load_le32(p + 6);
+}
+
+/* Worst-case encoded size of an n-byte block, header included: a block
+   that Huffman coding would not shrink is stored as it is */
+static inline size_t block_bound(size_t n) {
+    return BLOCK_HEADER_SIZE + n + BLOCK_CHECKSUM_SIZE;
+}
+
+/* Adaptive splitting cuts a block only between chunks of at least
+   SPLIT_MIN_CHUNK bytes, and into at most SPLIT_MAX_BLOCKS blocks */
+#define SPLIT_MAX_BLOCKS 64
+#define SPLIT_MIN_CHUNK  4096
+
+static inline size_t split_chunk_size(size_t n) {
+    size_t chunk = (n + SPLIT_MAX_BLOCKS - 1) / SPLIT_MAX_BLOCKS;
+    return chunk < SPLIT_MIN_CHUNK ? SPLIT_MIN_CHUNK : chunk;
+}
+
+/* Most blocks huf_encode_blocks() makes of n bytes */
+static inline size_t split_max_blocks(size_t n, int adaptive) {
+    return adaptive && n > SPLIT_MIN_CHUNK ? (n + split_chunk_size(n) - 1) / split_chunk_size(n) : 1;
+}
+
+/* Worst-case size of those blocks together */
+static inline size_t split_bound(size_t n, int adaptive) {
+    return n + split_max_blocks(n, adaptive) * (BLOCK_HEADER_SIZE + BLOCK_CHECKSUM_SIZE);
+}
+
+/* Largest block a reader must accept: encoders from before stored blocks
+   wrote Huffman blocks whatever their size */
+static inline size_t block_read_bound(size_t n) {
+    return BLOCK_HEADER_SIZE + CODE_LENGTHS_MAX_BYTES + 12 + (n * MAX_CODE_LEN + 7) / 8 + 4 * 8 +
+           BLOCK_CHECKSUM_SIZE;
+}
+
+/* -------------------- Statistics -------------------- */
+
+/* What the coders measure when handed a HufStats; with NULL they skip the
+   clock reads and the extra counting altogether. */
+enum { PH_HISTOGRAM, PH_TREE, PH_TABLE, PH_CODE, PH_TRANSFORM, PH_COUNT };
+
+typedef struct {
+    uint64_t ns[PH_COUNT];  /* time per phase, summed over threads */
+    uint64_t freq[256];     /* byte counts of the uncompressed data */
+    uint64_t coded_bits;    /* Huffman-coded bits, tables and padding excluded */
+    uint64_t coded_symbols; /* bytes those bits stand for */
+    uint64_t blocks[BT_COUNT]; /* blocks by type */
+    int max_code_len;       /* longest code in use */
+} HufStats;
+
+static inline uint64_t huf_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Charge the time since *t to phase and restart *t; no-op without stats */
+static inline void huf_stats_lap(HufStats *st, int phase, uint64_t *t) {
+    if (!st) return;
+    uint64_t now = huf_now_ns();
+    st->ns[phase] += now - *t;
+    *t = now;
+}
+
+/* Count freq as coded with table */
+void huf_stats_add_codes(HufStats *st, const uint32_t freq[256], const Code table[256]);
+void huf_stats_merge(HufStats *dst, const HufStats *src);
+
+/* -------------------- Block Coding -------------------- */
+
+/* Encode src[0..n) (n > 0) as one self-contained block into dst, which must
+   hold block_bound(n) bytes. Returns the block's total size. st may be NULL. */
+size_t huf_encode_block(const uint8_t *src, size_t n, uint8_t *dst, const HuffParams *params,
+                        HufStats *st);
+
+/* Where huf_encode_blocks() cut its input */
+typedef struct {
+    size_t count;
+    uint32_t original_size[SPLIT_MAX_BLOCKS];
+    uint32_t stored_size[SPLIT_MAX_BLOCKS];
+} BlockSplit;
+
+/* Encode src[0..n) (n > 0) into dst, which must hold split_bound(n,
+   params->adaptive) bytes: as one block, or with params->adaptive as
+   consecutive blocks cut where the byte statistics shift enough to pay for
+   another table. Returns the total size; split lists the blocks. */
+size_t huf_encode_blocks(const uint8_t *src, size_t n, uint8_t *dst, const HuffParams *params,
+                         HufStats *st, BlockSplit *split);
+
+/* huf_decode_block flags */
+#define BLOCK_DECODE_MULTI  0x01  /* use the multi-symbol table */
+#define BLOCK_DECODE_VERIFY 0x02  /* check the block's CRC32C if it has one */
+
+/* Decode a block's payload into dst (h->original_size bytes), building the
+   block's table in dt. st may be NULL. */
+int huf_decode_block(const BlockHeader *h, const uint8_t *payload, uint8_t *dst,
+                     DecodeTable *dt, int flags, HufStats *st);
+
+/* -------------------- Dictionaries -------------------- */
+
+/* Serialize a dictionary trained on the given byte counts into dst, which
+   must hold HUFF_DICT_MAX_SIZE bytes. Returns the bytes written. */
+size_t huf_dict_from_counts(const uint64_t counts[256], int max_code_len, uint8_t *dst);
+
+#endif /* HUFF_INTERNAL_H */
@@ -1,403 +1,2856 @@
-/* huff.c
- * Huffman compression/decompression using:
- * - Linear data structure: singly linked list (priority queue)
- * - Non-linear data structure: binary tree (Huffman tree)
- *
- * Format:
- *  [4 bytes]  Magic "HUF1"
- *  [8 bytes]  Original file size (uint64_t, little-endian)
- *  [256*4]    Frequency table of bytes (uint32_t, little-endian)
- *  [payload]  Huffman-encoded bitstream (MSB-first within bytes)
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <errno.h>
-
-/* -------------------- Utilities -------------------- */
-
-static void die(const char *msg) {
-    perror(msg);
-    exit(EXIT_FAILURE);
-}
-
-static void die_msg(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
-    exit(EXIT_FAILURE);
-}
-
-static size_t fread_or_die(void *ptr, size_t size, size_t nmemb, FILE *f, const char *ctx) {
-    size_t got = fread(ptr, size, nmemb, f);
-    if (got != nmemb) {
-        if (ferror(f)) die(ctx);
-        /* EOF allowed in some contexts; caller should check returned size */
-    }
-    return got;
-}
-
-static void fwrite_or_die(const void *ptr, size_t size, size_t nmemb, FILE *f, const char *ctx) {
-    if (fwrite(ptr, size, nmemb, f) != nmemb) die(ctx);
-}
-
-/* -------------------- Data Structures -------------------- */
-
-/* Non-linear structure: Huffman Tree Node */
-typedef struct Node {
-    uint32_t freq;
-    int is_leaf;
-    uint16_t symbol;       /* 0..255 if leaf */
-    struct Node *left;
-    struct Node *right;
-} Node;
-
-/* Linear structure: singly linked list node for priority queue */
-typedef struct ListNode {
-    Node *tree;
-    struct ListNode *next;
-} ListNode;
-
-/* Create a new tree node */
-static Node* make_node(uint32_t freq, int is_leaf, uint16_t symbol, Node *l, Node *r) {
-    Node *n = (Node*)malloc(sizeof(Node));
-    if (!n) die("malloc");
-    n->freq = freq;
-    n->is_leaf = is_leaf;
-    n->symbol = symbol;
-    n->left = l;
-    n->right = r;
-    return n;
-}
-
-/* Insert tree node into sorted linked list by ascending freq */
-static void list_insert_sorted(ListNode **head, Node *tree) {
-    ListNode *ln = (ListNode*)malloc(sizeof(ListNode));
-    if (!ln) die("malloc");
-    ln->tree = tree;
-    ln->next = NULL;
-
-    if (!*head || (*head)->tree->freq > tree->freq) {
-        ln->next = *head;
-        *head = ln;
-        return;
-    }
-    ListNode *cur = *head;
-    while (cur->next && cur->next->tree->freq <= tree->freq) {
-        cur = cur->next;
-    }
-    ln->next = cur->next;
-    cur->next = ln;
-}
-
-/* Pop the smallest-frequency tree from list */
-static Node* list_pop_front(ListNode **head) {
-    if (!*head) return NULL;
-    ListNode *ln = *head;
-    Node *t = ln->tree;
-    *head = ln->next;
-    free(ln);
-    return t;
-}
-
-/* Free entire Huffman tree */
-static void free_tree(Node *root) {
-    if (!root) return;
-    free_tree(root->left);
-    free_tree(root->right);
-    free(root);
-}
-
-/* -------------------- Bit I/O -------------------- */
-
-typedef struct {
-    FILE *f;
-    uint8_t buf;
-    int bits_filled; /* number of bits already in buf [0..7] */
-} BitWriter;
-
-static void bw_init(BitWriter *bw, FILE *f) {
-    bw->f = f;
-    bw->buf = 0;
-    bw->bits_filled = 0;
-}
-
-/* Write one bit (0/1), MSB-first in output bytes */
-static void bw_write_bit(BitWriter *bw, int bit) {
-    bw->buf = (bw->buf << 1) | (bit ? 1 : 0);
-    bw->bits_filled++;
-    if (bw->bits_filled == 8) {
-        fwrite_or_die(&bw->buf, 1, 1, bw->f, "fwrite(bit)");
-        bw->buf = 0;
-        bw->bits_filled = 0;
-    }
-}
-
-static void bw_write_bits(BitWriter *bw, uint32_t code, int len) {
-    /* code's most significant (len) bits are written first */
-    for (int i = len - 1; i >= 0; --i) {
-        int bit = (code >> i) & 1u;
-        bw_write_bit(bw, bit);
-    }
-}
-
-static void bw_flush(BitWriter *bw) {
-    if (bw->bits_filled > 0) {
-        /* pad remaining with zeros in LSB */
-        bw->buf <<= (8 - bw->bits_filled);
-        fwrite_or_die(&bw->buf, 1, 1, bw->f, "fwrite(flush)");
-        bw->buf = 0;
-        bw->bits_filled = 0;
-    }
-}
-
-typedef struct {
-    FILE *f;
-    uint8_t buf;
-    int bits_left; /* number of unread bits in buf [0..8] */
-} BitReader;
-
-static void br_init(BitReader *br, FILE *f) {
-    br->f = f;
-    br->buf = 0;
-    br->bits_left = 0;
-}
-
-/* Returns 0/1 for a bit, and sets *ok=0 on EOF without a full byte */
-static int br_read_bit(BitReader *br, int *ok) {
-    if (br->bits_left == 0) {
-        size_t got = fread(&br->buf, 1, 1, br->f);
-        if (got != 1) {
-            *ok = 0;
-            return 0;
-        }
-        br->bits_left = 8;
-    }
-    int bit = (br->buf >> 7) & 1;
-    br->buf <<= 1;
-    br->bits_left--;
-    *ok = 1;
-    return bit;
-}
-
-/* -------------------- Huffman Core -------------------- */
-
-/* Build Huffman tree from frequency table. Uses linked list as min-PQ. */
-static Node* build_huffman_tree(const uint32_t freq[256]) {
-    ListNode *pq = NULL;
-    int symbols = 0;
-    for (int i = 0; i < 256; ++i) {
-        if (freq[i] > 0) {
-            Node *leaf = make_node(freq[i], 1, (uint16_t)i, NULL, NULL);
-            list_insert_sorted(&pq, leaf);
-            symbols++;
-        }
-    }
-    if (symbols == 0) {
-        return NULL; /* empty file: no tree */
-    }
-    if (symbols == 1) {
-        /* Special: single symbol; create a parent to ensure at least one bit */
-        Node *only = list_pop_front(&pq);
-        Node *root = make_node(only->freq, 0, 0, only, NULL);
-        return root;
-    }
-    while (pq && pq->next) {
-        Node *a = list_pop_front(&pq);
-        Node *b = list_pop_front(&pq);
-        Node *parent = make_node(a->freq + b->freq, 0, 0, a, b);
-        list_insert_sorted(&pq, parent);
-    }
-    Node *root = list_pop_front(&pq);
-    return root;
-}
-
-/* Code table: for each byte, a (code, length) pair */
-typedef struct {
-    uint32_t code;
-    uint8_t  len;
-} Code;
-
-static void build_codes_dfs(Node *n, Code table[256], uint32_t path, uint8_t depth) {
-    if (!n) return;
-    if (n->is_leaf) {
-        table[n->symbol].code = (depth ? path : 0);  /* if single symbol, depth might be 0 */
-        table[n->symbol].len  = (depth ? depth : 1); /* ensure at least 1-bit code */
-        return;
-    }
-    /* Left = 0, Right = 1 */
-    build_codes_dfs(n->left,  table, (path << 1) | 0u, depth + 1);
-    build_codes_dfs(n->right, table, (path << 1) | 1u, depth + 1);
-}
-
-static void build_code_table(Node *root, Code table[256]) {
-    for (int i = 0; i < 256; ++i) {
-        table[i].code = 0;
-        table[i].len = 0;
-    }
-    if (root) build_codes_dfs(root, table, 0, 0);
-}
-
-/* -------------------- File Header IO -------------------- */
-
-static const uint8_t MAGIC[4] = { 'H', 'U', 'F', '1' };
-
-static void write_header(FILE *out, uint64_t original_size, const uint32_t freq[256]) {
-    fwrite_or_die(MAGIC, 1, 4, out, "fwrite(magic)");
-    fwrite_or_die(&original_size, sizeof(original_size), 1, out, "fwrite(size)");
-    for (int i = 0; i < 256; ++i) {
-        fwrite_or_die(&freq[i], sizeof(uint32_t), 1, out, "fwrite(freq)");
-    }
-}
-
-static void read_header(FILE *in, uint64_t *original_size, uint32_t freq[256]) {
-    uint8_t magic[4];
-    if (fread(magic, 1, 4, in) != 4) die_msg("Invalid or truncated file (magic).");
-    if (memcmp(magic, MAGIC, 4) != 0) die_msg("Not a HUF1 file (bad magic).");
-    if (fread(original_size, sizeof(*original_size), 1, in) != 1) die_msg("Truncated header (size).");
-    for (int i = 0; i < 256; ++i) {
-        if (fread(&freq[i], sizeof(uint32_t), 1, in) != 1) die_msg("Truncated header (freq).");
-    }
-}
-
-/* -------------------- Compression -------------------- */
-
-static void compress_file(const char *inpath, const char *outpath) {
-    FILE *in = fopen(inpath, "rb");
-    if (!in) die("fopen input");
-    FILE *out = fopen(outpath, "wb");
-    if (!out) die("fopen output");
-
-    uint32_t freq[256] = {0};
-    uint64_t original_size = 0;
-
-    /* 1) Count frequencies */
-    {
-        uint8_t buf[1<<15];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-            original_size += n;
-            for (size_t i = 0; i < n; ++i) {
-                freq[buf[i]]++;
-            }
-        }
-        if (ferror(in)) die("fread input");
-    }
-
-    /* 2) Build tree and code table */
-    Node *root = build_huffman_tree(freq);
-    Code table[256];
-    build_code_table(root, table);
-
-    /* 3) Write header */
-    write_header(out, original_size, freq);
-
-    /* 4) Encode data */
-    BitWriter bw;
-    bw_init(&bw, out);
-    if (original_size > 0) {
-        if (fseek(in, 0, SEEK_SET) != 0) die("fseek");
-        uint8_t buf[1<<15];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-            for (size_t i = 0; i < n; ++i) {
-                Code c = table[buf[i]];
-                /* Safety: ensure there's a code (length > 0) */
-                if (c.len == 0) {
-                    /* happens only if freq was zero, which shouldn't occur for seen bytes */
-                    die_msg("Internal error: missing code.");
-                }
-                bw_write_bits(&bw, c.code, c.len);
-            }
-        }
-        if (ferror(in)) die("fread input");
-    }
-    bw_flush(&bw);
-
-    free_tree(root);
-    fclose(in);
-    fclose(out);
-}
-
-/* -------------------- Decompression -------------------- */
-
-static void decompress_file(const char *inpath, const char *outpath) {
-    FILE *in = fopen(inpath, "rb");
-    if (!in) die("fopen input");
-    FILE *out = fopen(outpath, "wb");
-    if (!out) die("fopen output");
-
-    uint64_t original_size = 0;
-    uint32_t freq[256];
-    read_header(in, &original_size, freq);
-
-    Node *root = build_huffman_tree(freq);
-
-    /* Special cases */
-    if (original_size == 0) {
-        /* Nothing to decode */
-        free_tree(root);
-        fclose(in);
-        fclose(out);
-        return;
-    }
-    if (!root) {
-        die_msg("Corrupt file: missing Huffman tree.");
-    }
-
-    BitReader br;
-    br_init(&br, in);
-
-    /* If only one distinct symbol existed, tree may have only left child.
-       We handle uniformly by walking until we hit a leaf. */
-    uint64_t written = 0;
-    Node *cur = root;
-    int ok = 1;
-
-    while (written < original_size) {
-        if (cur->is_leaf) {
-            uint8_t byte = (uint8_t)cur->symbol;
-            fwrite_or_die(&byte, 1, 1, out, "fwrite(decode)");
-            written++;
-            cur = root;
-            continue;
-        }
-        int bit = br_read_bit(&br, &ok);
-        if (!ok) {
-            /* Ran out of bits before writing expected bytes */
-            die_msg("Unexpected end of encoded data.");
-        }
-        cur = (bit == 0) ? cur->left : cur->right;
-        if (!cur) die_msg("Corrupt Huffman tree or data.");
-    }
-
-    free_tree(root);
-    fclose(in);
-    fclose(out);
-}
-
-/* -------------------- CLI -------------------- */
-
-static void usage(const char *prog) {
-    fprintf(stderr,
-        "Usage:\n"
-        "  %s -c <input> <output.huf>   Compress\n"
-        "  %s -d <input.huf> <output>   Decompress\n",
-        prog, prog);
-}
-
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-    if (strcmp(argv[1], "-c") == 0) {
-        compress_file(argv[2], argv[3]);
-    } else if (strcmp(argv[1], "-d") == 0) {
-        decompress_file(argv[2], argv[3]);
-    } else {
-        usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+/* huff.c
+ * Huffman compression/decompression using:
+ * - Linear data structures: two FIFO queues over a sorted array (encoder),
+ *   singly linked list priority queue (HUF1 reader)
+ * - Non-linear data structure: binary tree (Huffman tree)
+ *
+ * Format (HUF3, written by -c): independently coded blocks plus an index
+ *  [4 bytes]  Magic "HUF3"
+ *  [4 bytes]  Nominal block size (uint32_t): no block is larger, and
+ *             with --adaptive blocks are cut shorter where the data shifts
+ *  Blocks, each with its own code table:
+ *   [1 byte]  Block type: 1 = Huffman, 2 = stored, 3 = run of one byte,
+ *             4 = order-1 Huffman, 5 = LZ77
+ *   [1 byte]  Flags: 0x01 = four interleaved streams, 0x02 = checksum,
+ *             0x04 = RLE4
+ *   [4 bytes] Original size of the block (uint32_t)
+ *   [4 bytes] Payload size: bytes that follow this 10-byte header (uint32_t)
+ *   [payload] Huffman: code length table (as in HUF2), then the block's
+ *             bitstream; with 0x01, three uint32_t sizes of streams 0..2
+ *             come first and stream k codes the k-th quarter of the block.
+ *             Order-1: [1] table count T - 1 (T <= 8), the table of
+ *             each previous-byte context as 256 ceil(log2 T)-bit fields
+ *             (MSB-first), T code length tables, then the bitstreams as
+ *             for Huffman; each byte is coded with the table of the byte
+ *             before it, and every stream starts in context 0.
+ *             LZ77: [4] sequence count S, then four nested blocks (header
+ *             and payload of type 1..4, flag 0x01 at most): the literals,
+ *             and one code per sequence for the literal length, the match
+ *             length - 4 and the offset; then a bitstream (MSB-first)
+ *             with the extra bits of each sequence in that order. Length
+ *             codes 0..15 are the value, code c >= 16 is 2^(c - 12) plus
+ *             c - 12 extra bits; offset code c is 2^c plus c extra bits.
+ *             Each sequence copies its literals, then match-length bytes
+ *             from offset bytes back; leftover literals end the block.
+ *             With 0x04 the payload starts with the size (uint32_t) of
+ *             the RLE4 form of the block, which the rest codes: after
+ *             four equal bytes comes a count of 0..255 more of them.
+ *             Stored: the original bytes. Run: the one byte value.
+ *             Stored and run blocks take no flag but 0x02. With 0x02
+ *             the payload ends with the CRC32C of the block's original
+ *             bytes (uint32_t), which -d --verify checks.
+ *  Block index:
+ *   [1 byte]  0 (index marker)
+ *   [1 byte]  0
+ *   [4 bytes] Block count N
+ *   [4 bytes] Entry bytes that follow (16 * N)
+ *   N entries: [8] block offset from the magic, [4] original size,
+ *              [4] stored size including the block header
+ *  Trailer:
+ *   [8 bytes] Index offset from the magic
+ *   [8 bytes] Total original size
+ *   [4 bytes] Magic "HUFX"
+ *  Another HUF3 file may follow the trailer, with offsets from its own
+ *  magic and a block size of its own; -d decodes them in turn (with
+ *  --mem, none may have larger blocks than the first). --append instead
+ *  writes more blocks after the trailer, then an index of all the blocks
+ *  and a new trailer, so the archive is intact until the new trailer is
+ *  down. The old index and trailer stay where they were: entries skip
+ *  over them, and the gap before the entry of block k is an index of k
+ *  entries plus its trailer.
+ *  All multi-byte fields are little-endian.
+ *
+ * Single-stream format (HUF2, written by -c --block-size 0):
+ *  [4 bytes]  Magic "HUF2"
+ *  [8 bytes]  Original file size (uint64_t, little-endian)
+ *  [1 byte]   Code length table encoding:
+ *               0 = none (empty input)
+ *               1 = sparse: [1] symbol count - 1, then (symbol, length) pairs
+ *               2 = packed: 128 bytes, 4 bits per symbol, even symbol high
+ *  [payload]  Canonical Huffman bitstream (MSB-first within bytes)
+ *
+ * Dictionary-coded format (HUFD, written by -c --dict), for small inputs:
+ *  [4 bytes]  Magic "HUFD"
+ *  [4 bytes]  ID of the dictionary (uint32_t, little-endian)
+ *  [1-10]     Original size, LEB128 varint
+ *  [payload]  Bitstream coded with the dictionary's table
+ * Dictionary file (written by --train):
+ *  [4 bytes]  Magic "HUFT"
+ *  [4 bytes]  ID: FNV-1a hash of the 256 code lengths
+ *  [varies]   Code length table as in HUF2; every byte has a code
+ *
+ * Legacy format (HUF1, still readable):
+ *  [4 bytes]  Magic "HUF1"
+ *  [8 bytes]  Original file size (uint64_t, little-endian)
+ *  [256*4]    Frequency table of bytes (uint32_t, little-endian)
+ *  [payload]  Huffman-encoded bitstream, codes taken from the tree shape
+ *
+ * The coding itself lives in libhuff.c, which also offers an in-memory API
+ * for the same formats (huff.h); this file is the command-line tool.
+ *
+ * Build: cc -O2 -pthread -o huff huffman.c libhuff.c -lm
+ */
+
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "huff_internal.h"
+
+/* -------------------- Utilities -------------------- */
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die_msg(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static size_t fread_or_die(void *ptr, size_t size, size_t nmemb, FILE *f, const char *ctx) {
+    size_t got = fread(ptr, size, nmemb, f);
+    if (got != nmemb) {
+        if (ferror(f)) die(ctx);
+        /* EOF allowed in some contexts; caller should check returned size */
+    }
+    return got;
+}
+
+static void fwrite_or_die(const void *ptr, size_t size, size_t nmemb, FILE *f, const char *ctx) {
+    if (fwrite(ptr, size, nmemb, f) != nmemb) die(ctx);
+}
+
+/* "-" names stdin/stdout, so the tool can sit in a pipeline */
+static FILE *open_input(const char *path) {
+    if (strcmp(path, "-") == 0) return stdin;
+    FILE *f = fopen(path, "rb");
+    if (!f) die("fopen input");
+    return f;
+}
+
+/* Read-write, as a shared mapping of the output needs */
+static FILE *open_output(const char *path) {
+    if (strcmp(path, "-") == 0) return stdout;
+    FILE *f = fopen(path, "w+b");
+    if (!f) die("fopen output");
+    return f;
+}
+
+static void close_input(FILE *f) {
+    if (f != stdin) fclose(f);
+}
+
+static void close_output(FILE *f) {
+    if (f == stdout) {
+        if (fflush(f) != 0) die("fflush output");
+    } else if (fclose(f) != 0) {
+        die("fclose output");
+    }
+}
+
+static int is_seekable(FILE *f) {
+    return fseeko(f, 0, SEEK_CUR) == 0;
+}
+
+static int is_regular_file(FILE *f) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* -------------------- Input -------------------- */
+
+/* Regular files are mmap'd once, so the counting and coding passes read
+   straight from the page cache; pipes and special files fall back to
+   fread into a scratch buffer the caller provides. */
+typedef struct {
+    FILE *f;
+    const uint8_t *map;   /* whole file, or NULL when reading with fread */
+    uint64_t size;        /* length of the mapping */
+    uint64_t start;       /* stream position when the input was opened */
+    uint64_t pos;         /* current position */
+} Input;
+
+static void input_init(Input *in, FILE *f, int use_mmap) {
+    in->f = f;
+    in->map = NULL;
+    in->size = 0;
+    off_t start = ftello(f);
+    in->start = in->pos = start > 0 ? (uint64_t)start : 0;
+
+    struct stat st;
+    if (!use_mmap || start < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) return;
+    if (st.st_size <= start || (uint64_t)st.st_size > SIZE_MAX) return;
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (m == MAP_FAILED) return;
+    posix_madvise(m, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    in->map = (const uint8_t*)m;
+    in->size = (uint64_t)st.st_size;
+}
+
+static void input_free(Input *in) {
+    if (in->map) munmap((void*)in->map, (size_t)in->size);
+    in->map = NULL;
+}
+
+/* Get up to n bytes (fewer only at EOF). A mapped input hands out a pointer
+   into the mapping; otherwise the bytes are read into scratch. */
+static size_t input_read(Input *in, uint8_t *scratch, size_t n, const uint8_t **data) {
+    if (in->map) {
+        uint64_t left = in->size - in->pos;
+        if (n > left) n = (size_t)left;
+        *data = in->map + in->pos;
+        in->pos += n;
+        return n;
+    }
+    size_t got = fread(scratch, 1, n, in->f);
+    if (got < n && ferror(in->f)) die("fread input");
+    in->pos += got;
+    *data = scratch;
+    return got;
+}
+
+/* Copy exactly n bytes into dst; returns 0 on a short read */
+static int input_read_exact(Input *in, void *dst, size_t n) {
+    const uint8_t *p;
+    if (input_read(in, (uint8_t*)dst, n, &p) != n) return 0;
+    if (p != dst) memcpy(dst, p, n);
+    return 1;
+}
+
+/* The rest of the input in one piece, preceded by the head_len bytes just
+   read from it. A mapped input is returned in place; otherwise the bytes
+   are gathered in a buffer the caller frees through *owned. */
+static const uint8_t *input_read_all(Input *in, const uint8_t *head, size_t head_len,
+                                     size_t *len, uint8_t **owned) {
+    *owned = NULL;
+    if (in->map) {
+        const uint8_t *p = in->map + in->pos - head_len;
+        *len = (size_t)(in->size - in->pos) + head_len;
+        in->pos = in->size;
+        return p;
+    }
+    size_t cap = head_len + BIT_IO_BUF_SIZE, n = head_len;
+    uint8_t *buf = (uint8_t*)malloc(cap);
+    if (!buf) die("malloc");
+    if (head_len) memcpy(buf, head, head_len);
+    for (;;) {
+        if (n == cap) {
+            cap *= 2;
+            buf = (uint8_t*)realloc(buf, cap);
+            if (!buf) die("realloc");
+        }
+        size_t got = fread(buf + n, 1, cap - n, in->f);
+        if (got == 0) break;
+        n += got;
+        in->pos += got;
+    }
+    if (ferror(in->f)) die("fread input");
+    *len = n;
+    *owned = buf;
+    return buf;
+}
+
+static void input_rewind(Input *in) {
+    if (!in->map && fseeko(in->f, (off_t)in->start, SEEK_SET) != 0) die("fseek");
+    in->pos = in->start;
+}
+
+/* -------------------- Output -------------------- */
+
+/* A decoder that knows the output size up front writes into a shared
+   mapping of the output file instead of staging bytes through a buffer
+   and fwrite. The file is allocated first, so a full disk fails here
+   rather than as SIGBUS on a page of the mapping. NULL, with nothing
+   written, if out is not a regular file at offset 0, size is 0 or the
+   mapping fails (stdout opened write-only by the shell); the caller then
+   writes to out as usual. */
+static uint8_t *output_map(FILE *out, uint64_t size, int use_mmap) {
+    if (!use_mmap || size == 0 || size > SIZE_MAX || !is_regular_file(out) || ftello(out) != 0) {
+        return NULL;
+    }
+    int fd = fileno(out);
+    if (ftruncate(fd, (off_t)size) != 0) return NULL;
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    if (err == ENOSPC || err == EFBIG) {
+        errno = err;
+        die("posix_fallocate output");
+    }
+    void *m = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return m == MAP_FAILED ? NULL : (uint8_t*)m;
+}
+
+static void output_unmap(uint8_t *map, uint64_t size) {
+    if (map && munmap(map, (size_t)size) != 0) die("munmap output");
+}
+
+/* -------------------- Data Structures -------------------- */
+
+/* Linear structure: singly linked list node for priority queue */
+typedef struct ListNode {
+    Node *tree;
+    struct ListNode *next;
+} ListNode;
+
+/* Create a new tree node */
+static Node* make_node(uint32_t freq, int is_leaf, uint16_t symbol, Node *l, Node *r) {
+    Node *n = (Node*)malloc(sizeof(Node));
+    if (!n) die("malloc");
+    n->freq = freq;
+    n->is_leaf = is_leaf;
+    n->symbol = symbol;
+    n->left = l;
+    n->right = r;
+    return n;
+}
+
+/* Insert tree node into sorted linked list by ascending freq */
+static void list_insert_sorted(ListNode **head, Node *tree) {
+    ListNode *ln = (ListNode*)malloc(sizeof(ListNode));
+    if (!ln) die("malloc");
+    ln->tree = tree;
+    ln->next = NULL;
+
+    if (!*head || (*head)->tree->freq > tree->freq) {
+        ln->next = *head;
+        *head = ln;
+        return;
+    }
+    ListNode *cur = *head;
+    while (cur->next && cur->next->tree->freq <= tree->freq) {
+        cur = cur->next;
+    }
+    ln->next = cur->next;
+    cur->next = ln;
+}
+
+/* Pop the smallest-frequency tree from list */
+static Node* list_pop_front(ListNode **head) {
+    if (!*head) return NULL;
+    ListNode *ln = *head;
+    Node *t = ln->tree;
+    *head = ln->next;
+    free(ln);
+    return t;
+}
+
+/* Free entire Huffman tree */
+static void free_tree(Node *root) {
+    if (!root) return;
+    free_tree(root->left);
+    free_tree(root->right);
+    free(root);
+}
+
+/* -------------------- Huffman Core -------------------- */
+
+/* Build Huffman tree from frequency table. Uses linked list as min-PQ.
+   Kept for HUF1, whose codes depend on this exact tie-breaking. */
+static Node* build_huffman_tree(const uint32_t freq[256]) {
+    ListNode *pq = NULL;
+    int symbols = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] > 0) {
+            Node *leaf = make_node(freq[i], 1, (uint16_t)i, NULL, NULL);
+            list_insert_sorted(&pq, leaf);
+            symbols++;
+        }
+    }
+    if (symbols == 0) {
+        return NULL; /* empty file: no tree */
+    }
+    if (symbols == 1) {
+        /* Special: single symbol; create a parent to ensure at least one bit */
+        Node *only = list_pop_front(&pq);
+        Node *root = make_node(only->freq, 0, 0, only, NULL);
+        return root;
+    }
+    while (pq && pq->next) {
+        Node *a = list_pop_front(&pq);
+        Node *b = list_pop_front(&pq);
+        Node *parent = make_node(a->freq + b->freq, 0, 0, a, b);
+        list_insert_sorted(&pq, parent);
+    }
+    Node *root = list_pop_front(&pq);
+    return root;
+}
+
+/* HUF1 files used the raw tree path of each leaf instead of canonical codes */
+static void legacy_codes_dfs(Node *n, Code table[256], uint32_t path, uint8_t depth) {
+    if (!n) return;
+    if (n->is_leaf) {
+        table[n->symbol].code = (depth ? path : 0);  /* if single symbol, depth might be 0 */
+        table[n->symbol].len  = (depth ? depth : 1); /* ensure at least 1-bit code */
+        return;
+    }
+    /* Left = 0, Right = 1 */
+    legacy_codes_dfs(n->left,  table, (path << 1) | 0u, depth + 1);
+    legacy_codes_dfs(n->right, table, (path << 1) | 1u, depth + 1);
+}
+
+static void build_legacy_code_table(Node *root, Code table[256]) {
+    for (int i = 0; i < 256; ++i) {
+        table[i].code = 0;
+        table[i].len = 0;
+    }
+    if (root) legacy_codes_dfs(root, table, 0, 0);
+}
+
+/* -------------------- Options -------------------- */
+
+#define DEFAULT_OUT_BUF_SIZE (256u << 10)
+
+enum { DECODER_SINGLE, DECODER_MULTI };
+
+/* --stats: the core's phases plus the tool's own I/O, reported on stderr */
+enum { IO_HEADER, IO_READ, IO_WRITE, IO_FLUSH, IO_COUNT };
+
+typedef struct {
+    HufStats core;
+    uint64_t io_ns[IO_COUNT];     /* summed over threads, like core.ns */
+    uint64_t total_ns;            /* wall clock of the whole run */
+    uint64_t bytes_in, bytes_out;
+} RunStats;
+
+/* Start and stop timing a phase; both are free without --stats */
+static uint64_t stats_clock(const RunStats *rs) {
+    return rs ? huf_now_ns() : 0;
+}
+
+static void stats_io(RunStats *rs, int phase, uint64_t since) {
+    if (rs) rs->io_ns[phase] += huf_now_ns() - since;
+}
+
+static void stats_core(RunStats *rs, int phase, uint64_t since) {
+    if (rs) rs->core.ns[phase] += huf_now_ns() - since;
+}
+
+static void stats_merge(RunStats *dst, const RunStats *src) {
+    huf_stats_merge(&dst->core, &src->core);
+    for (int i = 0; i < IO_COUNT; ++i) dst->io_ns[i] += src->io_ns[i];
+}
+
+typedef struct DecodeBudget DecodeBudget;
+
+typedef struct {
+    HuffParams enc;        /* encoder settings; enc.block_size 0 = single HUF2 stream */
+    size_t out_buf_size;   /* decoder output buffer, written in one fwrite */
+    int threads;           /* worker threads for block coding */
+    int pipeline;          /* --pipeline: overlap I/O and coding on one worker */
+    int use_mmap;          /* map regular files instead of fread/fwrite */
+    int decoder;           /* DECODER_SINGLE or DECODER_MULTI */
+    const HuffDict *dict;  /* --dict: code against this trained table */
+    RunStats *stats;       /* --stats, or NULL */
+    int verify;            /* --verify: check block checksums while decoding */
+    int range;             /* -r: decode only [range_offset, +range_length) */
+    uint64_t range_offset, range_length;
+    uint64_t mem;          /* --mem: cap on what the decoder holds, 0 = none */
+    DecodeBudget *budget;  /* storage carved out under that cap, or NULL */
+} Options;
+
+static void options_init(Options *opt) {
+    huff_params_default(&opt->enc);
+    opt->out_buf_size = DEFAULT_OUT_BUF_SIZE;
+    opt->threads = 1;
+    opt->pipeline = 0;
+    opt->use_mmap = 1;
+    opt->decoder = DECODER_MULTI;
+    opt->dict = NULL;
+    opt->stats = NULL;
+    opt->verify = 0;
+    opt->range = 0;
+    opt->range_offset = opt->range_length = 0;
+    opt->mem = 0;
+    opt->budget = NULL;
+}
+
+#define MAX_THREADS 256
+
+static int block_decode_flags(const Options *opt) {
+    return (opt->decoder == DECODER_MULTI ? BLOCK_DECODE_MULTI : 0) | (opt->verify ? BLOCK_DECODE_VERIFY : 0);
+}
+
+/* -------------------- File Header IO -------------------- */
+
+static const uint8_t MAGIC_V1[4] = { 'H', 'U', 'F', '1' };
+
+/* Returns the header's size */
+static size_t write_header(FILE *out, uint64_t original_size, const uint8_t lens[256]) {
+    uint8_t hdr[4 + 8 + CODE_LENGTHS_MAX_BYTES];
+    memcpy(hdr, MAGIC_V2, 4);
+    store_le64(hdr + 4, original_size);
+    size_t n = 12 + huf_pack_code_lengths(lens, hdr + 12);
+    fwrite_or_die(hdr, 1, n, out, "fwrite(header)");
+    return n;
+}
+
+/* HUF1: the frequency table is turned back into the same tree the encoder
+   built, since the codes were taken from its shape. */
+static void read_header_v1(Input *in, uint64_t *original_size, Code table[256]) {
+    uint32_t freq[256];
+    if (!input_read_exact(in, original_size, sizeof(*original_size))) die_msg("Truncated header (size).");
+    if (!input_read_exact(in, freq, sizeof(freq))) die_msg("Truncated header (freq).");
+    Node *root = build_huffman_tree(freq);
+    if (!root && *original_size > 0) die_msg("Corrupt file: missing Huffman tree.");
+    build_legacy_code_table(root, table);
+    free_tree(root);
+}
+
+/* HUF2: canonical codes are rebuilt from the stored lengths; no tree needed */
+static void read_header_v2(Input *in, uint64_t *original_size, Code table[256]) {
+    uint8_t hdr[8 + CODE_LENGTHS_MAX_BYTES];
+    if (!input_read_exact(in, hdr, 8)) die_msg("Truncated header (size).");
+    *original_size = load_le64(hdr);
+    uint8_t *cl = hdr + 8;
+    size_t have = 0, need;
+    while ((need = huf_code_lengths_size(cl, have)) > have) {
+        if (!input_read_exact(in, cl + have, need - have)) die_msg("Truncated header (code lengths).");
+        have = need;
+    }
+    uint8_t lens[256];
+    if (need == 0 || huf_unpack_code_lengths(cl, have, lens) == 0) die_msg("Corrupt header (code lengths).");
+    /* an empty input has no usable code, and nothing is decoded with it */
+    if (*original_size == 0) {
+        memset(table, 0, 256 * sizeof(Code));
+        return;
+    }
+    if (!huf_code_lengths_valid(lens)) die_msg("Corrupt header (code lengths).");
+    huf_assign_canonical_codes(lens, table);
+}
+
+/* Single-stream headers, after the magic has been read */
+static void read_header(Input *in, const uint8_t magic[4], uint64_t *original_size, Code table[256]) {
+    if (memcmp(magic, MAGIC_V2, 4) == 0) {
+        read_header_v2(in, original_size, table);
+    } else {
+        read_header_v1(in, original_size, table);
+    }
+}
+
+/* -------------------- Block Container -------------------- */
+
+typedef struct {
+    uint64_t offset;         /* of the block header, from the magic */
+    uint32_t original_size;
+    uint32_t stored_size;    /* block header + payload */
+} BlockEntry;
+
+typedef struct {
+    BlockEntry *v;
+    size_t n, cap;
+} BlockIndex;
+
+static void index_push(BlockIndex *ix, uint64_t offset, uint32_t original_size, uint32_t stored_size) {
+    if (ix->n == ix->cap) {
+        ix->cap = ix->cap ? ix->cap * 2 : 64;
+        ix->v = (BlockEntry*)realloc(ix->v, ix->cap * sizeof(BlockEntry));
+        if (!ix->v) die("realloc");
+    }
+    ix->v[ix->n].offset = offset;
+    ix->v[ix->n].original_size = original_size;
+    ix->v[ix->n].stored_size = stored_size;
+    ix->n++;
+}
+
+/* Bytes that the index and trailer of n blocks take */
+static uint64_t index_size(size_t n) {
+    return BLOCK_HEADER_SIZE + (uint64_t)n * INDEX_ENTRY_SIZE + TRAILER_SIZE;
+}
+
+static void write_index(FILE *out, const BlockIndex *ix, uint64_t index_offset, uint64_t total) {
+    uint8_t hdr[BLOCK_HEADER_SIZE];
+    BlockHeader h = { BT_INDEX, 0, (uint32_t)ix->n, (uint32_t)(ix->n * INDEX_ENTRY_SIZE) };
+    store_block_header(hdr, &h);
+    fwrite_or_die(hdr, 1, sizeof(hdr), out, "fwrite(index)");
+    for (size_t i = 0; i < ix->n; ++i) {
+        uint8_t e[INDEX_ENTRY_SIZE];
+        store_le64(e, ix->v[i].offset);
+        store_le32(e + 8, ix->v[i].original_size);
+        store_le32(e + 12, ix->v[i].stored_size);
+        fwrite_or_die(e, 1, sizeof(e), out, "fwrite(index)");
+    }
+    uint8_t t[TRAILER_SIZE];
+    store_le64(t, index_offset);
+    store_le64(t + 8, total);
+    memcpy(t + 16, MAGIC_TRAILER, 4);
+    fwrite_or_die(t, 1, sizeof(t), out, "fwrite(trailer)");
+}
+
+/* Load the index of a seekable HUF3 file via its trailer and check that the
+   entries tile the file, apart from the indexes --append left behind.
+   Returns 0 if the input cannot seek, or if the trailer does not lead to
+   an index just before it: the file is then taken to hold several block
+   sequences back to back, which only the sequential reader follows (and
+   which it rejects if it is just corrupt). The read position is left
+   alone when it returns 0. */
+static int read_block_index(FILE *in, size_t block_size, BlockIndex *ix, uint64_t *total) {
+    off_t pos = ftello(in);
+    if (pos < 0 || fseeko(in, -(off_t)TRAILER_SIZE, SEEK_END) != 0) return 0;
+    off_t end = ftello(in);
+    if (end < 0) return 0;
+
+    uint8_t t[TRAILER_SIZE];
+    if (fread(t, 1, sizeof(t), in) != sizeof(t)) die_msg("Truncated trailer.");
+    if (memcmp(t + 16, MAGIC_TRAILER, 4) != 0) die_msg("Corrupt trailer.");
+    uint64_t index_offset = load_le64(t);
+    *total = load_le64(t + 8);
+    if (index_offset < FILE_HEADER_SIZE || index_offset + BLOCK_HEADER_SIZE > (uint64_t)end) {
+        die_msg("Corrupt trailer.");
+    }
+
+    if (fseeko(in, (off_t)index_offset, SEEK_SET) != 0) die("fseek");
+    uint8_t bh[BLOCK_HEADER_SIZE];
+    if (fread(bh, 1, sizeof(bh), in) != sizeof(bh)) die_msg("Truncated block index.");
+    BlockHeader h;
+    load_block_header(bh, &h);
+    if (h.type != BT_INDEX || h.flags != 0 ||
+        (uint64_t)h.payload_size != (uint64_t)h.original_size * INDEX_ENTRY_SIZE ||
+        index_offset + BLOCK_HEADER_SIZE + h.payload_size != (uint64_t)end) {
+        if (fseeko(in, pos, SEEK_SET) != 0) die("fseek");
+        return 0;
+    }
+
+    uint64_t offset = FILE_HEADER_SIZE, sum = 0;
+    for (uint32_t i = 0; i < h.original_size; ++i) {
+        uint8_t e[INDEX_ENTRY_SIZE];
+        if (fread(e, 1, sizeof(e), in) != sizeof(e)) die_msg("Truncated block index.");
+        uint64_t off = load_le64(e);
+        uint32_t orig = load_le32(e + 8), stored = load_le32(e + 12);
+        if (off == offset + index_size(i)) offset = off;  /* an earlier index */
+        if (off != offset || orig == 0 || orig > block_size ||
+            stored <= BLOCK_HEADER_SIZE || stored > block_read_bound(block_size)) {
+            die_msg("Corrupt block index.");
+        }
+        index_push(ix, off, orig, stored);
+        offset += stored;
+        sum += orig;
+    }
+    if (offset != index_offset || sum != *total) die_msg("Corrupt block index.");
+    return 1;
+}
+
+/* -------------------- Compression -------------------- */
+
+/* HUF2: one table for the whole input, which is read twice */
+static void compress_single(Input *in, FILE *out, const Options *opt) {
+    uint64_t counts[256] = {0};
+    uint64_t original_size = 0;
+    uint8_t buf[1<<15];
+    const uint8_t *data;
+    size_t n;
+    RunStats *rs = opt->stats;
+    uint64_t t;
+
+    /* 1) Count frequencies */
+    for (;;) {
+        t = stats_clock(rs);
+        n = input_read(in, buf, sizeof(buf), &data);
+        stats_io(rs, IO_READ, t);
+        if (n == 0) break;
+        t = stats_clock(rs);
+        original_size += n;
+        uint32_t chunk[256] = {0};
+        huf_histogram(data, n, chunk);
+        for (int i = 0; i < 256; ++i) counts[i] += chunk[i];
+        stats_core(rs, PH_HISTOGRAM, t);
+    }
+
+    /* 2) Build tree and canonical code table; past 4G the counts are
+          scaled down first so the tree's weights cannot overflow */
+    t = stats_clock(rs);
+    uint32_t freq[256];
+    huf_normalize_counts(counts, freq);
+    Code table[256];
+    huf_build_code_table(freq, table, opt->enc.max_code_len);
+    stats_core(rs, PH_TREE, t);
+
+    /* 3) Write header: only the code lengths are stored */
+    t = stats_clock(rs);
+    uint8_t lens[256];
+    for (int i = 0; i < 256; ++i) lens[i] = table[i].len;
+    uint64_t written = write_header(out, original_size, lens);
+    stats_io(rs, IO_HEADER, t);
+
+    /* 4) Encode data, each input chunk's bits going out in one fwrite; the
+          partial word stays in the accumulator for the next chunk */
+    size_t cap = sizeof(buf) * MAX_CODE_LEN / 8 + 8;
+    uint8_t *obuf = (uint8_t*)malloc(cap);
+    if (!obuf) die("malloc");
+    BitWriter bw;
+    bw_init_mem(&bw, obuf, cap);
+    if (original_size > 0) {
+        input_rewind(in);
+        for (;;) {
+            t = stats_clock(rs);
+            n = input_read(in, buf, sizeof(buf), &data);
+            stats_io(rs, IO_READ, t);
+            if (n == 0) break;
+            t = stats_clock(rs);
+            for (size_t i = 0; i < n; ++i) {
+                Code c = table[data[i]];
+                /* Safety: ensure there's a code (length > 0) */
+                if (c.len == 0) {
+                    /* happens only if freq was zero, which shouldn't occur for seen bytes */
+                    die_msg("Internal error: missing code.");
+                }
+                bw_write_bits(&bw, c.code, c.len);
+            }
+            stats_core(rs, PH_CODE, t);
+            if (rs) {
+                uint32_t chunk[256] = {0};
+                huf_histogram(data, n, chunk);
+                huf_stats_add_codes(&rs->core, chunk, table);
+            }
+            t = stats_clock(rs);
+            fwrite_or_die(bw.buf, 1, bw.pos, out, "fwrite(bits)");
+            stats_io(rs, IO_WRITE, t);
+            written += bw.pos;
+            bw.pos = 0;
+        }
+    }
+    bw_flush(&bw);
+    fwrite_or_die(bw.buf, 1, bw.pos, out, "fwrite(flush)");
+    written += bw.pos;
+    free(obuf);
+    if (rs) {
+        rs->bytes_in = original_size;
+        rs->bytes_out = written;
+    }
+}
+
+/* HUF3 file header: magic and nominal block size */
+static void write_blocks_header(FILE *out, size_t block_size) {
+    uint8_t hdr[FILE_HEADER_SIZE];
+    memcpy(hdr, MAGIC_V3, 4);
+    store_le32(hdr + 4, (uint32_t)block_size);
+    fwrite_or_die(hdr, 1, sizeof(hdr), out, "fwrite(header)");
+}
+
+/* Offset just past the blocks of ix, where the next one goes */
+static uint64_t index_end(const BlockIndex *ix) {
+    return ix->n ? ix->v[ix->n - 1].offset + ix->v[ix->n - 1].stored_size : FILE_HEADER_SIZE;
+}
+
+/* HUF3: each block is read once, counted and encoded from memory. The
+   blocks go at offset, where out is, after those already in ix, which
+   holds total bytes: empty for a new file, whose header has been written,
+   or the index of an archive being appended to. */
+static void compress_blocks(Input *in, FILE *out, const Options *opt, BlockIndex *ix, uint64_t offset,
+                            uint64_t total) {
+    RunStats *rs = opt->stats;
+    uint64_t t;
+    uint8_t *ibuf = in->map ? NULL : (uint8_t*)malloc(opt->enc.block_size);
+    uint8_t *obuf = (uint8_t*)malloc(split_bound(opt->enc.block_size, opt->enc.adaptive));
+    if ((!in->map && !ibuf) || !obuf) die("malloc");
+    BlockSplit split;
+
+    const uint8_t *data;
+    size_t n;
+    for (;;) {
+        t = stats_clock(rs);
+        n = input_read(in, ibuf, opt->enc.block_size, &data);
+        stats_io(rs, IO_READ, t);
+        if (n == 0) break;
+        size_t size = huf_encode_blocks(data, n, obuf, &opt->enc, rs ? &rs->core : NULL, &split);
+        t = stats_clock(rs);
+        fwrite_or_die(obuf, 1, size, out, "fwrite(block)");
+        stats_io(rs, IO_WRITE, t);
+        for (size_t i = 0; i < split.count; ++i) {
+            index_push(ix, offset, split.original_size[i], split.stored_size[i]);
+            offset += split.stored_size[i];
+        }
+        total += n;
+    }
+
+    t = stats_clock(rs);
+    write_index(out, ix, offset, total);
+    stats_io(rs, IO_HEADER, t);
+    if (rs) {
+        rs->bytes_in = total;
+        rs->bytes_out = offset + index_size(ix->n);
+    }
+    free(ibuf);
+    free(obuf);
+}
+
+/* -j N or --pipeline: the calling thread reads blocks into a ring of
+   slots, N workers code them, and one writer thread emits them in order, so
+   reading, coding and writing overlap even with a single worker. A slot
+   goes FREE -> READ -> CODED -> FREE; block seq always lives in slot
+   seq % nslots, so the ring also bounds how far reading can run ahead. */
+enum { SLOT_FREE, SLOT_READ, SLOT_CODED };
+
+typedef struct {
+    uint8_t *ibuf, *obuf;
+    const uint8_t *src;  /* the block's bytes: ibuf, or the input mapping */
+    size_t n;       /* input bytes */
+    size_t size;    /* coded bytes in obuf */
+    BlockSplit split;  /* coding: the blocks in obuf */
+    BlockHeader h;  /* decoding: the block's header */
+    size_t icap, ocap;  /* decoding: buffer sizes, which grow with the blocks */
+    int state;
+} BlockSlot;
+
+/* One slot each for the reader and the writer, the rest for the workers */
+static size_t pipeline_slots(int threads) {
+    return threads > 1 ? 2 * (size_t)threads : 3;
+}
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    BlockSlot *slots;
+    size_t nslots;
+    uint64_t read_seq;   /* blocks handed to the workers so far */
+    uint64_t claim_seq;  /* next block a worker will pick up */
+    int eof;
+    const Options *opt;
+    FILE *out;
+    BlockIndex ix;
+    uint64_t offset, total;
+} CompressPool;
+
+static void *compress_worker(void *arg) {
+    CompressPool *p = (CompressPool*)arg;
+    HufStats local = {0};
+    HufStats *st = p->opt->stats ? &local : NULL;
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        while (p->claim_seq == p->read_seq && !p->eof) pthread_cond_wait(&p->cv, &p->mu);
+        if (p->claim_seq == p->read_seq) break;
+        BlockSlot *sl = &p->slots[p->claim_seq++ % p->nslots];
+        pthread_mutex_unlock(&p->mu);
+
+        sl->size = huf_encode_blocks(sl->src, sl->n, sl->obuf, &p->opt->enc, st, &sl->split);
+
+        pthread_mutex_lock(&p->mu);
+        sl->state = SLOT_CODED;
+        pthread_cond_broadcast(&p->cv);
+    }
+    /* the reader and writer threads own the I/O figures */
+    if (st) huf_stats_merge(&p->opt->stats->core, st);
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+static void *compress_writer(void *arg) {
+    CompressPool *p = (CompressPool*)arg;
+    for (uint64_t seq = 0;; ++seq) {
+        BlockSlot *sl = &p->slots[seq % p->nslots];
+        pthread_mutex_lock(&p->mu);
+        while (sl->state != SLOT_CODED && !(p->eof && seq == p->read_seq)) {
+            pthread_cond_wait(&p->cv, &p->mu);
+        }
+        int done = sl->state != SLOT_CODED;
+        pthread_mutex_unlock(&p->mu);
+        if (done) break;
+
+        uint64_t t = stats_clock(p->opt->stats);
+        fwrite_or_die(sl->obuf, 1, sl->size, p->out, "fwrite(block)");
+        stats_io(p->opt->stats, IO_WRITE, t);
+        for (size_t i = 0; i < sl->split.count; ++i) {
+            index_push(&p->ix, p->offset, sl->split.original_size[i], sl->split.stored_size[i]);
+            p->offset += sl->split.stored_size[i];
+        }
+        p->total += sl->n;
+
+        pthread_mutex_lock(&p->mu);
+        sl->state = SLOT_FREE;
+        pthread_cond_broadcast(&p->cv);
+        pthread_mutex_unlock(&p->mu);
+    }
+    return NULL;
+}
+
+/* Blocks go after those in ix, as for compress_blocks */
+static void compress_blocks_parallel(Input *in, FILE *out, const Options *opt, BlockIndex *ix,
+                                     uint64_t offset, uint64_t total) {
+    RunStats *rs = opt->stats;
+    uint64_t t;
+    CompressPool p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.mu, NULL);
+    pthread_cond_init(&p.cv, NULL);
+    p.opt = opt;
+    p.out = out;
+    p.ix = *ix;
+    p.offset = offset;
+    p.total = total;
+    p.nslots = pipeline_slots(opt->threads);
+    p.slots = (BlockSlot*)calloc(p.nslots, sizeof(BlockSlot));
+    if (!p.slots) die("calloc");
+    for (size_t i = 0; i < p.nslots; ++i) {
+        p.slots[i].ibuf = in->map ? NULL : (uint8_t*)malloc(opt->enc.block_size);
+        p.slots[i].obuf = (uint8_t*)malloc(split_bound(opt->enc.block_size, opt->enc.adaptive));
+        if ((!in->map && !p.slots[i].ibuf) || !p.slots[i].obuf) die("malloc");
+    }
+
+    pthread_t workers[MAX_THREADS], writer;
+    for (int i = 0; i < opt->threads; ++i) {
+        if (pthread_create(&workers[i], NULL, compress_worker, &p) != 0) die_msg("pthread_create failed.");
+    }
+    if (pthread_create(&writer, NULL, compress_writer, &p) != 0) die_msg("pthread_create failed.");
+
+    for (uint64_t seq = 0;; ++seq) {
+        BlockSlot *sl = &p.slots[seq % p.nslots];
+        pthread_mutex_lock(&p.mu);
+        while (sl->state != SLOT_FREE) pthread_cond_wait(&p.cv, &p.mu);
+        pthread_mutex_unlock(&p.mu);
+
+        t = stats_clock(rs);
+        size_t n = input_read(in, sl->ibuf, opt->enc.block_size, &sl->src);
+        stats_io(rs, IO_READ, t);
+
+        pthread_mutex_lock(&p.mu);
+        if (n == 0) {
+            p.eof = 1;
+        } else {
+            sl->n = n;
+            sl->state = SLOT_READ;
+            p.read_seq++;
+        }
+        pthread_cond_broadcast(&p.cv);
+        pthread_mutex_unlock(&p.mu);
+        if (n == 0) break;
+    }
+
+    for (int i = 0; i < opt->threads; ++i) pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+
+    t = stats_clock(rs);
+    write_index(out, &p.ix, p.offset, p.total);
+    stats_io(rs, IO_HEADER, t);
+    if (rs) {
+        rs->bytes_in = p.total;
+        rs->bytes_out = p.offset + index_size(p.ix.n);
+    }
+    for (size_t i = 0; i < p.nslots; ++i) {
+        free(p.slots[i].ibuf);
+        free(p.slots[i].obuf);
+    }
+    free(p.slots);
+    *ix = p.ix;
+    pthread_cond_destroy(&p.cv);
+    pthread_mutex_destroy(&p.mu);
+}
+
+/* The dictionary coder has no per-block figures: count the bytes for
+   the entropy report */
+static void dict_stats(HufStats *st, const uint8_t *src, size_t n) {
+    uint32_t freq[256];
+    for (size_t done = 0; done < n;) {
+        size_t len = n - done < BIT_IO_BUF_SIZE ? n - done : BIT_IO_BUF_SIZE;
+        memset(freq, 0, sizeof(freq));
+        huf_histogram(src + done, len, freq);
+        for (int i = 0; i < 256; ++i) st->freq[i] += freq[i];
+        done += len;
+    }
+}
+
+/* HUFD: the whole input becomes one message against the dictionary */
+static void compress_dict(Input *in, FILE *out, const HuffDict *dict, RunStats *rs) {
+    size_t n;
+    uint8_t *owned;
+    uint64_t t = stats_clock(rs);
+    const uint8_t *src = input_read_all(in, NULL, 0, &n, &owned);
+    stats_io(rs, IO_READ, t);
+    size_t cap = huff_dict_compress_bound(dict, n);
+    uint8_t *dst = (uint8_t*)malloc(cap);
+    if (!dst) die("malloc");
+    size_t size;
+    t = stats_clock(rs);
+    int err = huff_compress_dict(dict, src, n, dst, cap, &size);
+    stats_core(rs, PH_CODE, t);
+    if (err != HUF_OK) die_msg(huff_error_string(err));
+    t = stats_clock(rs);
+    fwrite_or_die(dst, 1, size, out, "fwrite(message)");
+    stats_io(rs, IO_WRITE, t);
+    if (rs) {
+        dict_stats(&rs->core, src, n);
+        rs->bytes_in = n;
+        rs->bytes_out = size;
+    }
+    free(dst);
+    free(owned);
+}
+
+/* -j and --pipeline spread blocks over threads, and a single stream (HUF1,
+   HUF2 or a dictionary-coded message) has none to spread */
+static void warn_single_stream(const Options *opt) {
+    if (opt->threads > 1 || opt->pipeline) {
+        fprintf(stderr, "%s has no effect here: only HUF3 (block mode) files are coded on several threads.\n",
+                opt->pipeline ? "--pipeline" : "-j");
+    }
+}
+
+static void compress_file(const char *inpath, const char *outpath, const Options *opt) {
+    FILE *f = open_input(inpath);
+    Input in;
+    input_init(&in, f, opt->use_mmap);
+    if (!opt->dict && opt->enc.block_size == 0 && !in.map && !is_seekable(f)) {
+        die_msg("Single-stream mode (--block-size 0) reads the input twice and needs a seekable file.");
+    }
+    FILE *out = open_output(outpath);
+    if (opt->dict) warn_single_stream(opt);
+
+    if (opt->dict) {
+        compress_dict(&in, out, opt->dict, opt->stats);
+    } else if (opt->enc.block_size == 0) {
+        compress_single(&in, out, opt);
+    } else {
+        uint64_t t = stats_clock(opt->stats);
+        write_blocks_header(out, opt->enc.block_size);
+        stats_io(opt->stats, IO_HEADER, t);
+        BlockIndex ix = {0};
+        if (opt->threads > 1 || opt->pipeline) {
+            compress_blocks_parallel(&in, out, opt, &ix, FILE_HEADER_SIZE, 0);
+        } else {
+            compress_blocks(&in, out, opt, &ix, FILE_HEADER_SIZE, 0);
+        }
+        free(ix.v);
+    }
+
+    uint64_t t = stats_clock(opt->stats);
+    close_output(out);
+    stats_io(opt->stats, IO_FLUSH, t);
+    input_free(&in);
+    close_input(f);
+}
+
+/* --append: the archive and its size before the run, to which a run that
+   fails is cut back on the way out */
+static int append_fd = -1;
+static off_t append_size;
+
+static void append_rollback(void) {
+    if (append_fd >= 0 && ftruncate(append_fd, append_size) != 0) perror("ftruncate archive");
+}
+
+/* --append: code the input as new blocks at the end of an HUF3 archive,
+   after its trailer, and follow them with one index and trailer covering
+   the old and new blocks, so only the new data is read and coded. Nothing
+   before the old end is written, and a run that fails truncates the
+   archive back to it. An archive that does not exist yet is created. */
+static void append_file(const char *inpath, const char *archive, const Options *opt) {
+    FILE *out = fopen(archive, "r+b");
+    if (!out) {
+        if (errno != ENOENT) die("fopen archive");
+        compress_file(inpath, archive, opt);
+        return;
+    }
+    /* unbuffered, so nothing stdio holds reaches the file after a cut */
+    setvbuf(out, NULL, _IONBF, 0);
+    RunStats *rs = opt->stats;
+    uint64_t t = stats_clock(rs);
+    uint8_t hdr[FILE_HEADER_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), out) != sizeof(hdr) || memcmp(hdr, MAGIC_V3, 4) != 0) {
+        die_msg("--append needs a HUF3 (block mode) archive.");
+    }
+    size_t block_size = load_le32(hdr + 4);
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) die_msg("Corrupt header (block size).");
+    BlockIndex ix = {0};
+    uint64_t total = 0;
+    if (!read_block_index(out, block_size, &ix, &total)) {
+        die_msg("--append needs a seekable archive with a single block sequence.");
+    }
+    size_t blocks = ix.n;
+    uint64_t end = index_end(&ix) + index_size(ix.n);
+    if (fseeko(out, (off_t)end, SEEK_SET) != 0) die("fseek");
+    stats_io(rs, IO_HEADER, t);
+    append_fd = fileno(out);
+    append_size = (off_t)end;
+    atexit(append_rollback);
+
+    /* readers size their buffers by the archive's block size, so no new
+       block may be larger */
+    Options o = *opt;
+    if (o.enc.block_size > block_size) o.enc.block_size = block_size;
+    FILE *f = open_input(inpath);
+    Input in;
+    input_init(&in, f, o.use_mmap);
+    if (o.threads > 1 || o.pipeline) {
+        compress_blocks_parallel(&in, out, &o, &ix, end, total);
+    } else {
+        compress_blocks(&in, out, &o, &ix, end, total);
+    }
+    /* an empty input adds no blocks, and so no index either */
+    if (ix.n == blocks && ftruncate(append_fd, append_size) != 0) die("ftruncate archive");
+    append_fd = -1;
+    if (rs) {
+        /* count what this run added, not the whole archive */
+        rs->bytes_in -= total;
+        rs->bytes_out = ix.n == blocks ? 0 : rs->bytes_out - end;
+    }
+    free(ix.v);
+
+    t = stats_clock(rs);
+    close_output(out);
+    stats_io(rs, IO_FLUSH, t);
+    input_free(&in);
+    close_input(f);
+}
+
+/* -------------------- Decompression -------------------- */
+
+/* --mem: the buffers and decode tables of the sequential decoder, carved
+   from one allocation made before the first block is read, so a run never
+   holds more than the cap and allocates nothing while it decodes */
+struct DecodeBudget {
+    uint8_t *arena;
+    size_t size;
+    uint8_t *ibuf, *obuf;
+    size_t icap, ocap;
+    DecodeTable dt;
+};
+
+static size_t align16(size_t n) {
+    return (n + 15) & ~(size_t)15;
+}
+
+/* Lay out a budget for blocks of up to block_size bytes, or for a HUF1/HUF2
+   stream when block_size is 0. Dies if the buffers and the order-0 table
+   do not fit in opt->mem; order-1 tables and transform buffers are only
+   reserved when there is room left for them. */
+static void budget_init(DecodeBudget *b, size_t block_size, const Options *opt) {
+    uint64_t cap = opt->mem;
+    size_t tables = huf_decode_table_reserve(NULL, NULL, block_size, 0);
+    if (block_size) {
+        /* encoders since stored blocks never let one outgrow its input */
+        b->icap = block_size + BLOCK_CHECKSUM_SIZE;
+        b->ocap = block_size;
+    } else {
+        /* a stream decodes in chunks of any size, so shrink the output
+           buffer to what the cap leaves */
+        b->icap = BIT_IO_BUF_SIZE;
+        b->ocap = opt->out_buf_size;
+        uint64_t base = align16(b->icap) + tables;
+        if (base + b->ocap > cap) {
+            if (base + MIN_BLOCK_SIZE < cap) {
+                b->ocap = (size_t)(cap - base) & ~(size_t)15;
+            } else {
+                /* too little left: the size check below reports it */
+                b->ocap = MIN_BLOCK_SIZE;
+            }
+        }
+    }
+    size_t io = align16(b->icap) + align16(b->ocap);
+    uint64_t need = (uint64_t)io + tables;
+    if (need > cap) {
+        fprintf(stderr, "Decoding this file needs %llu bytes, over --mem %llu%s\n", (unsigned long long)need,
+                (unsigned long long)cap, block_size ? "; compress it with a smaller --block-size." : ".");
+        exit(EXIT_FAILURE);
+    }
+    int what = 0;
+    size_t order1 = 0, transforms = 0;
+    if (block_size) {
+        order1 = huf_decode_table_reserve(NULL, NULL, block_size, RESERVE_ORDER1) - tables;
+        transforms = huf_decode_table_reserve(NULL, NULL, block_size, RESERVE_TRANSFORMS) - tables;
+        if (need + order1 <= cap) {
+            what |= RESERVE_ORDER1;
+            need += order1;
+        } else {
+            order1 = 0;
+        }
+        if (need + transforms <= cap) {
+            what |= RESERVE_TRANSFORMS;
+            need += transforms;
+        } else {
+            transforms = 0;
+        }
+    }
+
+    /* touch every page now, so a system short of memory fails here and
+       not halfway through the output */
+    b->size = (size_t)need;
+    b->arena = (uint8_t*)malloc(b->size);
+    if (!b->arena) die("malloc");
+    memset(b->arena, 0, b->size);
+    b->ibuf = b->arena;
+    b->obuf = b->arena + align16(b->icap);
+    huf_decode_table_reserve(&b->dt, b->arena + io, block_size, what);
+    fprintf(stderr, "memory: %zu of %llu bytes reserved: I/O %zu, tables %zu, order-1 %zu, transforms %zu\n",
+            b->size, (unsigned long long)cap, io, tables, order1, transforms);
+}
+
+static void budget_free(DecodeBudget *b) {
+    free(b->arena);
+}
+
+/* A decode error; under --mem, running out of reserved storage is the
+   cap's doing rather than the system's */
+static void die_decode(int err, const Options *opt) {
+    if (err == HUF_ERR_MEMORY && opt->budget) die_msg("Decoding this file needs more memory than --mem allows.");
+    die_msg(huff_error_string(err));
+}
+
+static void decompress_single(Input *in, FILE *out, const uint8_t magic[4], const Options *opt) {
+    RunStats *rs = opt->stats;
+    uint64_t t = stats_clock(rs);
+    uint64_t original_size = 0;
+    Code table[256];
+    read_header(in, magic, &original_size, table);
+    stats_io(rs, IO_HEADER, t);
+    if (rs) rs->bytes_in = in->pos - in->start;
+
+    if (original_size == 0) {
+        /* Nothing to decode */
+        return;
+    }
+
+    /* A single-symbol input has just the 1-bit code 0 */
+    t = stats_clock(rs);
+    DecodeBudget *b = opt->budget;
+    DecodeTable own, *dt = b ? &b->dt : &own;
+    if (!b) huf_decode_table_init(&own);
+    int err = huf_decode_table_build(dt, table, opt->decoder == DECODER_MULTI);
+    if (err != HUF_OK) die_decode(err, opt);
+    stats_core(rs, PH_TABLE, t);
+
+    BitReader br;
+    uint8_t *ibuf = NULL;
+    if (in->map) {
+        br_init_mem(&br, in->map + in->pos, (size_t)(in->size - in->pos));
+    } else {
+        ibuf = b ? b->ibuf : (uint8_t*)malloc(BIT_IO_BUF_SIZE);
+        if (!ibuf) die("malloc");
+        br_init(&br, in->f, ibuf);
+    }
+
+    /* Decode straight into the mapped output, or into a large buffer that
+       goes to stdio in one call. Every code is at least one bit, so the
+       output is only sized up front when the input can hold that many. */
+    t = stats_clock(rs);
+    struct stat sb;
+    int fits = fstat(fileno(in->f), &sb) == 0 && S_ISREG(sb.st_mode) && (uint64_t)sb.st_size >= in->pos &&
+               original_size / 8 <= (uint64_t)sb.st_size - in->pos;
+    uint8_t *omap = fits ? output_map(out, original_size, opt->use_mmap) : NULL;
+    stats_io(rs, IO_WRITE, t);
+    size_t ocap = b ? b->ocap : opt->out_buf_size;
+    uint8_t *obuf = omap ? NULL : b ? b->obuf : (uint8_t*)malloc(ocap);
+    if (!omap && !obuf) die("malloc");
+
+    uint64_t written = 0;
+    while (written < original_size) {
+        uint64_t left = original_size - written;
+        size_t n = left < ocap ? (size_t)left : ocap;
+        uint8_t *dst = omap ? omap + written : obuf;
+        t = stats_clock(rs);
+        err = huf_decode_run(dt, &br, dst, n);
+        if (err != HUF_OK) die_msg(huff_error_string(err));
+        stats_core(rs, PH_CODE, t);
+        if (rs) {
+            uint32_t freq[256] = {0};
+            huf_histogram(dst, n, freq);
+            huf_stats_add_codes(&rs->core, freq, table);
+        }
+        if (!omap) {
+            t = stats_clock(rs);
+            fwrite_or_die(obuf, 1, n, out, "fwrite(decode)");
+            stats_io(rs, IO_WRITE, t);
+        }
+        written += n;
+    }
+    if (ferror(in->f)) die("fread input");
+    if (rs) {
+        /* the bit reader runs ahead of what it decodes; count the bits used */
+        rs->bytes_in += (rs->core.coded_bits + 7) / 8;
+        rs->bytes_out = original_size;
+    }
+
+    t = stats_clock(rs);
+    output_unmap(omap, original_size);
+    stats_io(rs, IO_FLUSH, t);
+    if (!b) {
+        free(obuf);
+        free(ibuf);
+        huf_decode_table_free(&own);
+    }
+}
+
+/* Check the index and trailer against the blocks that were just read,
+   whose entries add up to index_crc */
+static void check_index(Input *in, const BlockHeader *h, size_t blocks, uint32_t index_crc,
+                        uint64_t index_offset, uint64_t total) {
+    if (h->flags != 0 || h->original_size != blocks ||
+        h->payload_size != blocks * INDEX_ENTRY_SIZE) {
+        die_msg("Corrupt block index.");
+    }
+    uint32_t crc = 0;
+    for (size_t i = 0; i < blocks; ++i) {
+        uint8_t e[INDEX_ENTRY_SIZE];
+        if (!input_read_exact(in, e, sizeof(e))) die_msg("Truncated block index.");
+        crc = huf_crc32c_update(crc, e, sizeof(e));
+    }
+    if (crc != index_crc) die_msg("Corrupt block index.");
+    uint8_t t[TRAILER_SIZE];
+    if (!input_read_exact(in, t, sizeof(t))) die_msg("Truncated trailer.");
+    if (memcmp(t + 16, MAGIC_TRAILER, 4) != 0 || load_le64(t) != index_offset ||
+        load_le64(t + 8) != total) {
+        die_msg("Corrupt trailer.");
+    }
+}
+
+/* Sequential HUF3 reader state: the index entries the block headers imply
+   are summed into a CRC32C as they go by and checked against the stored
+   index at the end, so reading allocates nothing per block. A trailer may
+   be followed by another block sequence, as when archives are concatenated;
+   its offsets start again from its own magic. Or by blocks --append wrote,
+   which carry on the same sequence up to the next index. */
+typedef struct {
+    Input *in;
+    size_t max_block;    /* largest block size so far, to which the
+                            callers' buffers grow */
+    size_t block_size;   /* the current sequence's */
+    size_t icap;         /* largest payload a block may carry */
+    int fixed;           /* --mem: icap holds for the whole input */
+    size_t blocks;
+    uint32_t index_crc;
+    uint64_t offset;     /* in the current sequence */
+    uint64_t total;      /* over all sequences */
+    uint64_t seq_total;  /* of the sequences before the current one */
+    uint64_t seq_bytes;
+    uint8_t head[4];     /* start of the next block header, if nhead */
+    size_t nhead;
+} BlockReader;
+
+static void block_reader_init(BlockReader *r, Input *in, size_t block_size) {
+    memset(r, 0, sizeof(*r));
+    r->in = in;
+    r->max_block = r->block_size = block_size;
+    r->icap = block_read_bound(block_size) - BLOCK_HEADER_SIZE;
+    r->offset = FILE_HEADER_SIZE;
+}
+
+/* After a trailer: 0 at the end of the input, 1 once the next sequence's
+   header has been read or once appended blocks follow, the first header of
+   which (no block type starts like the magic) has begun in r->head */
+static int block_reader_sequence(BlockReader *r) {
+    uint8_t fh[FILE_HEADER_SIZE];
+    const uint8_t *p;
+    size_t got = input_read(r->in, fh, 4, &p);
+    if (got == 0) return 0;
+    if (got < 4) die_msg("Trailing data after block index.");
+    if (memcmp(p, MAGIC_V3, 4) != 0) {
+        memcpy(r->head, p, 4);
+        r->nhead = 4;
+        r->offset += index_size(r->blocks);
+        return 1;
+    }
+    if (!input_read_exact(r->in, fh, 4)) die_msg("Truncated header (block size).");
+    size_t block_size = load_le32(fh);
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) die_msg("Corrupt header (block size).");
+    if (block_size > r->max_block) {
+        if (r->fixed) die_msg("A concatenated block sequence has larger blocks than the first, over --mem.");
+        r->max_block = block_size;
+        r->icap = block_read_bound(block_size) - BLOCK_HEADER_SIZE;
+    }
+    r->seq_bytes += r->offset + index_size(r->blocks);
+    r->seq_total = r->total;
+    r->block_size = block_size;
+    r->blocks = 0;
+    r->index_crc = 0;
+    r->offset = FILE_HEADER_SIZE;
+    return 1;
+}
+
+/* Read the next block's header and payload (into *ibuf, of *ibuf_cap bytes,
+   unless the input is mapped; it grows if a sequence with larger blocks
+   comes along). Returns 0 once the last index and trailer have been read
+   and checked. */
+static int block_reader_next(BlockReader *r, uint8_t **ibuf, size_t *ibuf_cap, BlockHeader *h,
+                             const uint8_t **payload) {
+    uint8_t bh[BLOCK_HEADER_SIZE];
+    for (;;) {
+        memcpy(bh, r->head, r->nhead);
+        if (!input_read_exact(r->in, bh + r->nhead, sizeof(bh) - r->nhead)) {
+            die_msg("Truncated file (block header).");
+        }
+        r->nhead = 0;
+        load_block_header(bh, h);
+        if (h->type != BT_INDEX) break;
+        check_index(r->in, h, r->blocks, r->index_crc, r->offset, r->total - r->seq_total);
+        if (!block_reader_sequence(r)) return 0;
+    }
+    if (h->original_size == 0 || h->original_size > r->block_size ||
+        h->payload_size > block_read_bound(r->block_size) - BLOCK_HEADER_SIZE) {
+        die_msg("Corrupt block header.");
+    }
+    if (h->payload_size > r->icap) die_msg("Block too large for --mem (written by an older encoder).");
+    if (!r->in->map && *ibuf_cap < r->icap) {
+        *ibuf = (uint8_t*)realloc(*ibuf, r->icap);
+        if (!*ibuf) die("realloc");
+        *ibuf_cap = r->icap;
+    }
+    if (input_read(r->in, *ibuf, h->payload_size, payload) != h->payload_size) {
+        die_msg(huff_error_string(HUF_ERR_TRUNCATED));
+    }
+
+    uint32_t stored = (uint32_t)(BLOCK_HEADER_SIZE + h->payload_size);
+    uint8_t e[INDEX_ENTRY_SIZE];
+    store_le64(e, r->offset);
+    store_le32(e + 8, h->original_size);
+    store_le32(e + 12, stored);
+    r->index_crc = huf_crc32c_update(r->index_crc, e, sizeof(e));
+    r->blocks++;
+    r->offset += stored;
+    r->total += h->original_size;
+    return 1;
+}
+
+static void block_reader_stats(const BlockReader *r, RunStats *rs) {
+    if (!rs) return;
+    rs->bytes_in = r->seq_bytes + r->offset + index_size(r->blocks);
+    rs->bytes_out = r->total;
+}
+
+/* Original size of a seekable HUF3 input, from an index that has been
+   checked to tile the file and add up to it, so a damaged trailer cannot
+   make the output huge. Leaves the read position where it was; 0 if the
+   input cannot seek. */
+static int peek_total(Input *in, size_t block_size, uint64_t *total) {
+    off_t pos = ftello(in->f);
+    if (in->start != 0 || pos < 0) return 0;
+    BlockIndex ix = {0};
+    int ok = read_block_index(in->f, block_size, &ix, total);
+    free(ix.v);
+    if (ok && fseeko(in->f, pos, SEEK_SET) != 0) die("fseek");
+    return ok;
+}
+
+/* HUF3: blocks are read and decoded in file order */
+static void decompress_blocks(Input *in, FILE *out, size_t block_size, const Options *opt) {
+    BlockReader r;
+    block_reader_init(&r, in, block_size);
+    RunStats *rs = opt->stats;
+    /* Blocks are decoded into the mapped output when the trailer gives its
+       size, else collected in obuf and written out together */
+    uint64_t total = 0;
+    uint64_t t = stats_clock(rs);
+    uint8_t *omap = opt->use_mmap && peek_total(in, block_size, &total) ? output_map(out, total, 1) : NULL;
+    stats_io(rs, IO_WRITE, t);
+    DecodeBudget *b = opt->budget;
+    if (b) {
+        r.icap = b->icap;
+        r.fixed = 1;
+    }
+    size_t icap = r.icap;
+    size_t ocap = b ? b->ocap : opt->out_buf_size > block_size ? opt->out_buf_size : block_size;
+    uint8_t *ibuf = in->map ? NULL : b ? b->ibuf : (uint8_t*)malloc(icap);
+    uint8_t *obuf = omap ? NULL : b ? b->obuf : (uint8_t*)malloc(ocap);
+    if ((!in->map && !ibuf) || (!omap && !obuf)) die("malloc");
+    size_t ofill = 0;
+    DecodeTable own, *dt = b ? &b->dt : &own;
+    if (!b) huf_decode_table_init(&own);
+
+    BlockHeader h;
+    const uint8_t *payload;
+    for (;;) {
+        t = stats_clock(rs);
+        int more = block_reader_next(&r, &ibuf, &icap, &h, &payload);
+        stats_io(rs, IO_READ, t);
+        if (!more) break;
+        if (omap) {
+            /* r.total already counts this block */
+            if (r.total > total) die_msg("Corrupt trailer.");
+            int err = huf_decode_block(&h, payload, omap + (r.total - h.original_size), dt,
+                                       block_decode_flags(opt), rs ? &rs->core : NULL);
+            if (err != HUF_OK) die_decode(err, opt);
+            continue;
+        }
+        if (ofill + h.original_size > ocap) {
+            t = stats_clock(rs);
+            fwrite_or_die(obuf, 1, ofill, out, "fwrite(decode)");
+            stats_io(rs, IO_WRITE, t);
+            ofill = 0;
+            if (h.original_size > ocap) {  /* not under --mem, whose reader stops first */
+                ocap = r.max_block;
+                obuf = (uint8_t*)realloc(obuf, ocap);
+                if (!obuf) die("realloc");
+            }
+        }
+        int err = huf_decode_block(&h, payload, obuf + ofill, dt, block_decode_flags(opt),
+                                   rs ? &rs->core : NULL);
+        if (err != HUF_OK) die_decode(err, opt);
+        ofill += h.original_size;
+    }
+    t = stats_clock(rs);
+    if (ofill > 0) fwrite_or_die(obuf, 1, ofill, out, "fwrite(decode)");
+    stats_io(rs, IO_WRITE, t);
+    t = stats_clock(rs);
+    output_unmap(omap, total);
+    stats_io(rs, IO_FLUSH, t);
+    block_reader_stats(&r, rs);
+
+    if (!b) {
+        huf_decode_table_free(&own);
+        free(ibuf);
+        free(obuf);
+    }
+}
+
+/* The streaming counterpart of compress_blocks_parallel, for --pipeline
+   and for -j N when the input cannot seek or the output is a pipe: the
+   calling thread reads blocks, workers decode them into their slot and the
+   writer emits them in order. */
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    BlockSlot *slots;
+    size_t nslots;
+    uint64_t read_seq;   /* blocks handed to the workers so far */
+    uint64_t claim_seq;  /* next block a worker will pick up */
+    int eof;
+    const Options *opt;
+    FILE *out;
+} DecodePipe;
+
+static void *pipe_decode_worker(void *arg) {
+    DecodePipe *p = (DecodePipe*)arg;
+    HufStats local = {0};
+    HufStats *st = p->opt->stats ? &local : NULL;
+    DecodeTable dt;
+    huf_decode_table_init(&dt);
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        while (p->claim_seq == p->read_seq && !p->eof) pthread_cond_wait(&p->cv, &p->mu);
+        if (p->claim_seq == p->read_seq) break;
+        BlockSlot *sl = &p->slots[p->claim_seq++ % p->nslots];
+        pthread_mutex_unlock(&p->mu);
+
+        int err = huf_decode_block(&sl->h, sl->src, sl->obuf, &dt, block_decode_flags(p->opt), st);
+        if (err != HUF_OK) die_msg(huff_error_string(err));
+        sl->size = sl->h.original_size;
+
+        pthread_mutex_lock(&p->mu);
+        sl->state = SLOT_CODED;
+        pthread_cond_broadcast(&p->cv);
+    }
+    if (st) huf_stats_merge(&p->opt->stats->core, st);
+    pthread_mutex_unlock(&p->mu);
+    huf_decode_table_free(&dt);
+    return NULL;
+}
+
+static void *pipe_decode_writer(void *arg) {
+    DecodePipe *p = (DecodePipe*)arg;
+    for (uint64_t seq = 0;; ++seq) {
+        BlockSlot *sl = &p->slots[seq % p->nslots];
+        pthread_mutex_lock(&p->mu);
+        while (sl->state != SLOT_CODED && !(p->eof && seq == p->read_seq)) {
+            pthread_cond_wait(&p->cv, &p->mu);
+        }
+        int done = sl->state != SLOT_CODED;
+        pthread_mutex_unlock(&p->mu);
+        if (done) break;
+
+        uint64_t t = stats_clock(p->opt->stats);
+        fwrite_or_die(sl->obuf, 1, sl->size, p->out, "fwrite(decode)");
+        stats_io(p->opt->stats, IO_WRITE, t);
+
+        pthread_mutex_lock(&p->mu);
+        sl->state = SLOT_FREE;
+        pthread_cond_broadcast(&p->cv);
+        pthread_mutex_unlock(&p->mu);
+    }
+    return NULL;
+}
+
+static void decompress_blocks_pipelined(Input *in, FILE *out, size_t block_size, const Options *opt) {
+    BlockReader r;
+    block_reader_init(&r, in, block_size);
+
+    DecodePipe p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.mu, NULL);
+    pthread_cond_init(&p.cv, NULL);
+    p.opt = opt;
+    p.out = out;
+    p.nslots = pipeline_slots(opt->threads);
+    p.slots = (BlockSlot*)calloc(p.nslots, sizeof(BlockSlot));
+    if (!p.slots) die("calloc");
+    for (size_t i = 0; i < p.nslots; ++i) {
+        p.slots[i].icap = r.icap;
+        p.slots[i].ocap = block_size;
+        p.slots[i].ibuf = in->map ? NULL : (uint8_t*)malloc(r.icap);
+        p.slots[i].obuf = (uint8_t*)malloc(block_size);
+        if ((!in->map && !p.slots[i].ibuf) || !p.slots[i].obuf) die("malloc");
+    }
+
+    pthread_t workers[MAX_THREADS], writer;
+    for (int i = 0; i < opt->threads; ++i) {
+        if (pthread_create(&workers[i], NULL, pipe_decode_worker, &p) != 0) die_msg("pthread_create failed.");
+    }
+    if (pthread_create(&writer, NULL, pipe_decode_writer, &p) != 0) die_msg("pthread_create failed.");
+
+    for (uint64_t seq = 0;; ++seq) {
+        BlockSlot *sl = &p.slots[seq % p.nslots];
+        pthread_mutex_lock(&p.mu);
+        while (sl->state != SLOT_FREE) pthread_cond_wait(&p.cv, &p.mu);
+        pthread_mutex_unlock(&p.mu);
+
+        uint64_t t = stats_clock(opt->stats);
+        int more = block_reader_next(&r, &sl->ibuf, &sl->icap, &sl->h, &sl->src);
+        stats_io(opt->stats, IO_READ, t);
+        if (more && sl->h.original_size > sl->ocap) {
+            sl->ocap = r.max_block;
+            sl->obuf = (uint8_t*)realloc(sl->obuf, sl->ocap);
+            if (!sl->obuf) die("realloc");
+        }
+
+        pthread_mutex_lock(&p.mu);
+        if (!more) {
+            p.eof = 1;
+        } else {
+            sl->state = SLOT_READ;
+            p.read_seq++;
+        }
+        pthread_cond_broadcast(&p.cv);
+        pthread_mutex_unlock(&p.mu);
+        if (!more) break;
+    }
+
+    for (int i = 0; i < opt->threads; ++i) pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+    block_reader_stats(&r, opt->stats);
+
+    for (size_t i = 0; i < p.nslots; ++i) {
+        free(p.slots[i].ibuf);
+        free(p.slots[i].obuf);
+    }
+    free(p.slots);
+    pthread_cond_destroy(&p.cv);
+    pthread_mutex_destroy(&p.mu);
+}
+
+/* -j N on a seekable HUF3 file: workers take blocks from the index, pread
+   them and pwrite the decoded bytes at their final position, so neither
+   side goes through a shared FILE*. */
+typedef struct {
+    pthread_mutex_t mu;
+    const BlockIndex *ix;
+    const uint64_t *out_offset;  /* where each block's bytes go */
+    size_t next;                 /* next block to hand out */
+    size_t block_size;
+    const uint8_t *map;          /* input mapping, or NULL to pread */
+    uint8_t *omap;               /* output mapping, or NULL to pwrite */
+    int in_fd, out_fd;
+    const Options *opt;
+} DecompressPool;
+
+static void pread_or_die(int fd, void *buf, size_t n, off_t off) {
+    uint8_t *p = (uint8_t*)buf;
+    while (n > 0) {
+        ssize_t got = pread(fd, p, n, off);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            die("pread");
+        }
+        if (got == 0) die_msg("Truncated file (block).");
+        p += got;
+        n -= (size_t)got;
+        off += got;
+    }
+}
+
+static void pwrite_or_die(int fd, const void *buf, size_t n, off_t off) {
+    const uint8_t *p = (const uint8_t*)buf;
+    while (n > 0) {
+        ssize_t put = pwrite(fd, p, n, off);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            die("pwrite");
+        }
+        p += put;
+        n -= (size_t)put;
+        off += put;
+    }
+}
+
+static void *decompress_worker(void *arg) {
+    DecompressPool *p = (DecompressPool*)arg;
+    RunStats local = {0};
+    RunStats *rs = p->opt->stats ? &local : NULL;
+    uint8_t *ibuf = p->map ? NULL : (uint8_t*)malloc(block_read_bound(p->block_size));
+    uint8_t *obuf = p->omap ? NULL : (uint8_t*)malloc(p->block_size);
+    if ((!p->map && !ibuf) || (!p->omap && !obuf)) die("malloc");
+    DecodeTable dt;
+    huf_decode_table_init(&dt);
+    for (;;) {
+        pthread_mutex_lock(&p->mu);
+        size_t i = p->next++;
+        pthread_mutex_unlock(&p->mu);
+        if (i >= p->ix->n) break;
+
+        const BlockEntry *be = &p->ix->v[i];
+        const uint8_t *blk = ibuf;
+        uint64_t t = stats_clock(rs);
+        if (p->map) {
+            blk = p->map + be->offset;
+        } else {
+            pread_or_die(p->in_fd, ibuf, be->stored_size, (off_t)be->offset);
+        }
+        stats_io(rs, IO_READ, t);
+        BlockHeader h;
+        load_block_header(blk, &h);
+        if (h.original_size != be->original_size ||
+            BLOCK_HEADER_SIZE + (uint64_t)h.payload_size != be->stored_size) {
+            die_msg("Corrupt block header.");
+        }
+        uint8_t *dst = p->omap ? p->omap + p->out_offset[i] : obuf;
+        int err = huf_decode_block(&h, blk + BLOCK_HEADER_SIZE, dst, &dt, block_decode_flags(p->opt),
+                                   rs ? &rs->core : NULL);
+        if (err != HUF_OK) die_msg(huff_error_string(err));
+        if (!p->omap) {
+            t = stats_clock(rs);
+            pwrite_or_die(p->out_fd, obuf, h.original_size, (off_t)p->out_offset[i]);
+            stats_io(rs, IO_WRITE, t);
+        }
+    }
+    if (rs) {
+        pthread_mutex_lock(&p->mu);
+        stats_merge(p->opt->stats, rs);
+        pthread_mutex_unlock(&p->mu);
+    }
+    huf_decode_table_free(&dt);
+    free(ibuf);
+    free(obuf);
+    return NULL;
+}
+
+/* Returns 0 (having consumed nothing) if the input cannot seek or the
+   output is not a regular file, e.g. in a pipeline */
+static int decompress_blocks_parallel(Input *in, FILE *out, size_t block_size, const Options *opt) {
+    if (!is_regular_file(out)) return 0;
+    BlockIndex ix = {0};
+    uint64_t total = 0;
+    uint64_t t = stats_clock(opt->stats);
+    if (in->start != 0 || !read_block_index(in->f, block_size, &ix, &total)) return 0;
+    stats_io(opt->stats, IO_HEADER, t);
+
+    uint64_t *out_offset = (uint64_t*)malloc((ix.n ? ix.n : 1) * sizeof(uint64_t));
+    if (!out_offset) die("malloc");
+    uint64_t pos = 0;
+    for (size_t i = 0; i < ix.n; ++i) {
+        out_offset[i] = pos;
+        pos += ix.v[i].original_size;
+    }
+
+    DecompressPool p;
+    pthread_mutex_init(&p.mu, NULL);
+    p.ix = &ix;
+    p.out_offset = out_offset;
+    p.next = 0;
+    p.block_size = block_size;
+    p.map = in->map;
+    p.opt = opt;
+    p.in_fd = fileno(in->f);
+    p.out_fd = fileno(out);
+    /* the index has been checked to add up to total */
+    t = stats_clock(opt->stats);
+    p.omap = output_map(out, total, opt->use_mmap);
+    if (!p.omap && ftruncate(p.out_fd, (off_t)total) != 0) die("ftruncate");
+    stats_io(opt->stats, IO_WRITE, t);
+
+    pthread_t workers[MAX_THREADS];
+    int nthreads = opt->threads;
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&workers[i], NULL, decompress_worker, &p) != 0) die_msg("pthread_create failed.");
+    }
+    for (int i = 0; i < nthreads; ++i) pthread_join(workers[i], NULL);
+    t = stats_clock(opt->stats);
+    output_unmap(p.omap, total);
+    stats_io(opt->stats, IO_FLUSH, t);
+
+    if (opt->stats) {
+        opt->stats->bytes_in = (ix.n ? ix.v[ix.n - 1].offset + ix.v[ix.n - 1].stored_size : FILE_HEADER_SIZE) +
+                               index_size(ix.n);
+        opt->stats->bytes_out = total;
+    }
+    pthread_mutex_destroy(&p.mu);
+    free(out_offset);
+    free(ix.v);
+    return 1;
+}
+
+/* -r on a seekable HUF3 file: the index gives each block's place in the
+   original data, so only the blocks that overlap the range are read */
+static void decompress_range(Input *in, FILE *out, size_t block_size, const Options *opt) {
+    BlockIndex ix = {0};
+    uint64_t total = 0;
+    if (in->start != 0 || !read_block_index(in->f, block_size, &ix, &total)) {
+        die_msg("-r needs a seekable input with a single block sequence.");
+    }
+    uint64_t first = opt->range_offset;
+    if (first > total) die_msg("Range starts past the end of the data.");
+    uint64_t end = opt->range_length < total - first ? first + opt->range_length : total;
+
+    /* start[i] is where block i begins in the original data */
+    uint64_t *start = (uint64_t*)malloc((ix.n + 1) * sizeof(uint64_t));
+    if (!start) die("malloc");
+    start[0] = 0;
+    for (size_t i = 0; i < ix.n; ++i) start[i + 1] = start[i] + ix.v[i].original_size;
+    size_t lo = 0, hi = ix.n;  /* first block that ends after first */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (start[mid + 1] <= first) lo = mid + 1;
+        else hi = mid;
+    }
+
+    uint8_t *ibuf = in->map ? NULL : (uint8_t*)malloc(block_read_bound(block_size));
+    uint8_t *obuf = (uint8_t*)malloc(block_size);
+    if ((!in->map && !ibuf) || !obuf) die("malloc");
+    DecodeTable dt;
+    huf_decode_table_init(&dt);
+    RunStats *rs = opt->stats;
+    uint64_t read = 0;
+    for (size_t i = lo; i < ix.n && start[i] < end; ++i) {
+        const BlockEntry *be = &ix.v[i];
+        const uint8_t *blk = ibuf;
+        uint64_t t = stats_clock(rs);
+        if (in->map) {
+            blk = in->map + be->offset;
+        } else {
+            pread_or_die(fileno(in->f), ibuf, be->stored_size, (off_t)be->offset);
+        }
+        stats_io(rs, IO_READ, t);
+        read += be->stored_size;
+        BlockHeader h;
+        load_block_header(blk, &h);
+        if (h.original_size != be->original_size ||
+            BLOCK_HEADER_SIZE + (uint64_t)h.payload_size != be->stored_size) {
+            die_msg("Corrupt block header.");
+        }
+        int err = huf_decode_block(&h, blk + BLOCK_HEADER_SIZE, obuf, &dt, block_decode_flags(opt),
+                                   rs ? &rs->core : NULL);
+        if (err != HUF_OK) die_msg(huff_error_string(err));
+        size_t from = (size_t)(first > start[i] ? first - start[i] : 0);
+        size_t to = (size_t)(end < start[i + 1] ? end - start[i] : h.original_size);
+        t = stats_clock(rs);
+        fwrite_or_die(obuf + from, 1, to - from, out, "fwrite(decode)");
+        stats_io(rs, IO_WRITE, t);
+    }
+    if (rs) {
+        rs->bytes_in = read;
+        rs->bytes_out = end - first;
+    }
+
+    huf_decode_table_free(&dt);
+    free(obuf);
+    free(ibuf);
+    free(start);
+    free(ix.v);
+}
+
+static void decompress_dict(Input *in, FILE *out, const uint8_t magic[4], const HuffDict *dict,
+                            RunStats *rs) {
+    size_t n;
+    uint8_t *owned;
+    uint64_t t = stats_clock(rs);
+    const uint8_t *src = input_read_all(in, magic, 4, &n, &owned);
+    stats_io(rs, IO_READ, t);
+    uint64_t size;
+    int err = huff_decompressed_size(src, n, &size);
+    if (err != HUF_OK) die_msg(huff_error_string(err));
+    if (size > SIZE_MAX) die_msg("Message too large for memory.");
+    uint8_t *dst = (uint8_t*)malloc(size ? (size_t)size : 1);
+    if (!dst) die("malloc");
+    size_t got;
+    t = stats_clock(rs);
+    err = huff_decompress_dict(dict, src, n, dst, (size_t)size, &got);
+    if (err != HUF_OK) die_msg(huff_error_string(err));
+    stats_core(rs, PH_CODE, t);
+    t = stats_clock(rs);
+    fwrite_or_die(dst, 1, got, out, "fwrite(decode)");
+    stats_io(rs, IO_WRITE, t);
+    if (rs) {
+        dict_stats(&rs->core, dst, got);
+        rs->bytes_in = n;
+        rs->bytes_out = got;
+    }
+    free(dst);
+    free(owned);
+}
+
+static void decompress_file(const char *inpath, const char *outpath, const Options *opt) {
+    FILE *f = open_input(inpath);
+    /* under --mem, stdio keeps no buffers of its own */
+    if (opt->mem) setvbuf(f, NULL, _IONBF, 0);
+    Input in;
+    input_init(&in, f, opt->use_mmap);
+
+    uint8_t magic[4];
+    if (!input_read_exact(&in, magic, 4)) die_msg("Invalid or truncated file (magic).");
+    int blocks = memcmp(magic, MAGIC_V3, 4) == 0;
+    int dict = memcmp(magic, MAGIC_DICT_MSG, 4) == 0;
+    if (!blocks && !dict && memcmp(magic, MAGIC_V2, 4) != 0 && memcmp(magic, MAGIC_V1, 4) != 0) {
+        die_msg("Not a HUF1/HUF2/HUF3/HUFD file (bad magic).");
+    }
+    if (dict && !opt->dict) die_msg("Dictionary-coded input needs --dict.");
+    if (opt->range && !blocks) die_msg("-r needs a HUF3 (block mode) file.");
+    if (dict && opt->mem) die_msg("--mem does not cover dictionary-coded input.");
+    if (!blocks) warn_single_stream(opt);
+    size_t block_size = 0;
+    if (blocks) {
+        uint8_t fh[FILE_HEADER_SIZE - 4];
+        if (!input_read_exact(&in, fh, sizeof(fh))) die_msg("Truncated header (block size).");
+        block_size = load_le32(fh);
+        if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) die_msg("Corrupt header (block size).");
+    }
+
+    /* the budget is laid out before the output is created, so a cap that
+       is too small leaves no file behind */
+    DecodeBudget budget;
+    Options bounded;
+    if (opt->mem) {
+        budget_init(&budget, block_size, opt);
+        bounded = *opt;
+        bounded.budget = &budget;
+        opt = &bounded;
+    }
+    FILE *out = open_output(outpath);
+    if (opt->mem) setvbuf(out, NULL, _IONBF, 0);
+
+    if (dict) {
+        decompress_dict(&in, out, magic, opt->dict, opt->stats);
+    } else if (blocks) {
+        int done = opt->threads > 1 && !opt->range && decompress_blocks_parallel(&in, out, block_size, opt);
+        if (opt->range) {
+            decompress_range(&in, out, block_size, opt);
+        } else if (!done && (opt->threads > 1 || opt->pipeline)) {
+            decompress_blocks_pipelined(&in, out, block_size, opt);
+        } else if (!done) {
+            decompress_blocks(&in, out, block_size, opt);
+        }
+    } else {
+        decompress_single(&in, out, magic, opt);
+    }
+
+    uint64_t t = stats_clock(opt->stats);
+    close_output(out);
+    stats_io(opt->stats, IO_FLUSH, t);
+    if (opt->budget) budget_free(opt->budget);
+    input_free(&in);
+    close_input(f);
+}
+
+/* -------------------- Dictionaries -------------------- */
+
+/* --train: count the bytes of every sample file and write the table */
+static void train_dict(const char *outpath, const char *const *samples, int nsamples, int max_code_len) {
+    uint64_t counts[256] = {0};
+    uint8_t *buf = (uint8_t*)malloc(BIT_IO_BUF_SIZE);
+    if (!buf) die("malloc");
+    for (int s = 0; s < nsamples; ++s) {
+        FILE *f = open_input(samples[s]);
+        Input in;
+        input_init(&in, f, 1);
+        const uint8_t *data;
+        size_t n;
+        while ((n = input_read(&in, buf, BIT_IO_BUF_SIZE, &data)) > 0) {
+            uint32_t freq[256] = {0};
+            huf_histogram(data, n, freq);
+            for (int i = 0; i < 256; ++i) counts[i] += freq[i];
+        }
+        input_free(&in);
+        close_input(f);
+    }
+    free(buf);
+
+    uint8_t dict[HUFF_DICT_MAX_SIZE];
+    size_t size = huf_dict_from_counts(counts, max_code_len, dict);
+    FILE *out = open_output(outpath);
+    fwrite_or_die(dict, 1, size, out, "fwrite(dictionary)");
+    close_output(out);
+}
+
+static HuffDict *load_dict(const char *path) {
+    FILE *f = open_input(path);
+    uint8_t buf[HUFF_DICT_MAX_SIZE + 1];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    if (ferror(f)) die("fread dictionary");
+    close_input(f);
+    HuffDict *dict = n <= HUFF_DICT_MAX_SIZE ? huff_dict_create(buf, n) : NULL;
+    if (!dict) die_msg("Invalid dictionary file.");
+    return dict;
+}
+
+/* -------------------- Statistics -------------------- */
+
+static void print_stats(const RunStats *rs, int compress, int threaded) {
+    static const char *const core_names[PH_COUNT] = { "histogram", "tree build", "table build", NULL,
+                                                      "transform" };
+    static const char *const io_names[IO_COUNT] = { "header I/O", "read", "write", "flush" };
+    FILE *e = stderr;
+    uint64_t plain = compress ? rs->bytes_in : rs->bytes_out;
+    uint64_t packed = compress ? rs->bytes_out : rs->bytes_in;
+
+    fprintf(e, "bytes in          %llu\n", (unsigned long long)rs->bytes_in);
+    fprintf(e, "bytes out         %llu\n", (unsigned long long)rs->bytes_out);
+    if (packed > 0) fprintf(e, "ratio             %.4f\n", (double)plain / (double)packed);
+    for (int i = 0; i < PH_COUNT; ++i) {
+        const char *name = core_names[i] ? core_names[i] : compress ? "encode" : "decode";
+        fprintf(e, "%-17s %.3f ms\n", name, (double)rs->core.ns[i] / 1e6);
+    }
+    for (int i = 0; i < IO_COUNT; ++i) {
+        fprintf(e, "%-17s %.3f ms\n", io_names[i], (double)rs->io_ns[i] / 1e6);
+    }
+    fprintf(e, "total             %.3f ms%s\n", (double)rs->total_ns / 1e6,
+            threaded ? " (phases are summed over threads)" : "");
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) fprintf(e, "peak RSS          %ld KiB\n", ru.ru_maxrss);
+
+    uint64_t symbols = 0;
+    int distinct = 0;
+    for (int i = 0; i < 256; ++i) {
+        symbols += rs->core.freq[i];
+        distinct += rs->core.freq[i] != 0;
+    }
+    if (symbols > 0) {
+        double h = 0;
+        for (int i = 0; i < 256; ++i) {
+            if (rs->core.freq[i] == 0) continue;
+            double q = (double)rs->core.freq[i] / (double)symbols;
+            h -= q * log2(q);
+        }
+        fprintf(e, "entropy           %.4f bits/symbol\n", h);
+        fprintf(e, "achieved          %.4f bits/symbol\n", 8.0 * (double)packed / (double)symbols);
+        if (rs->core.coded_symbols > 0) {
+            fprintf(e, "  Huffman-coded   %.4f bits/symbol (no tables, headers or padding)\n",
+                    (double)rs->core.coded_bits / (double)rs->core.coded_symbols);
+        }
+    }
+    fprintf(e, "max code length   %d\n", rs->core.max_code_len);
+    fprintf(e, "distinct symbols  %d\n", distinct);
+    const uint64_t *b = rs->core.blocks;
+    if (b[BT_HUFFMAN] + b[BT_RAW] + b[BT_RLE] + b[BT_ORDER1] + b[BT_LZ77] > 0) {
+        fprintf(e, "blocks            %llu Huffman, %llu order-1, %llu LZ77, %llu stored, %llu run\n",
+                (unsigned long long)b[BT_HUFFMAN], (unsigned long long)b[BT_ORDER1], (unsigned long long)b[BT_LZ77],
+                (unsigned long long)b[BT_RAW], (unsigned long long)b[BT_RLE]);
+    }
+}
+
+/* -------------------- Benchmark -------------------- */
+
+/* --bench: compress and decompress each input in memory through libhuff,
+   so the numbers cover the coder and not the disk. Without files it runs
+   a built-in corpus, which is the same on every machine and version. */
+#define BENCH_CORPUS_SIZE (4u << 20)
+#define DEFAULT_BENCH_ITERATIONS 5
+
+enum { BENCH_CSV, BENCH_JSON };
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t size;
+} BenchInput;
+
+static uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void bench_fill(const char *name, uint8_t *p, size_t n) {
+    static const char *const words[] = {
+        "the", "of", "and", "a", "to", "in", "is", "block", "code", "tree",
+        "table", "stream", "length", "symbol", "frequency", "compression",
+    };
+    uint64_t s = 0x9E3779B97F4A7C15u;
+    if (strcmp(name, "text") == 0) {
+        size_t i = 0, col = 0;
+        while (i < n) {
+            const char *w = words[bench_rand(&s) % (sizeof(words) / sizeof(words[0]))];
+            for (; *w && i < n; ++w, ++col) p[i++] = (uint8_t)*w;
+            if (i < n) p[i++] = col > 70 ? '\n' : ' ';
+            col = col > 70 ? 0 : col + 1;
+        }
+    } else if (strcmp(name, "binary") == 0) {
+        /* 16-byte records: a counter, a small field and some noise */
+        for (size_t i = 0; i < n; ++i) {
+            size_t r = i / 16, k = i % 16;
+            uint64_t v = k < 8 ? (uint64_t)r >> (8 * k) : k < 12 ? (r % 7) >> (8 * (k - 8)) : bench_rand(&s);
+            p[i] = (uint8_t)v;
+        }
+    } else if (strcmp(name, "random") == 0) {
+        for (size_t i = 0; i < n; ++i) p[i] = (uint8_t)bench_rand(&s);
+    } else if (strcmp(name, "single") == 0) {
+        memset(p, 'a', n);
+    } else {
+        /* skewed: byte k with probability 2^-(k+1) */
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t r = bench_rand(&s) | ((uint64_t)1 << 63);
+            int k = 0;
+            while (!(r & 1)) {
+                r >>= 1;
+                ++k;
+            }
+            p[i] = (uint8_t)k;
+        }
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted v[0..n) */
+static double percentile(const double *v, int n, int pct) {
+    int rank = (pct * n + 99) / 100;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+typedef struct {
+    double mbps, p50, p90, p99;  /* MB/s at the median; run times in ms */
+} BenchPhase;
+
+static void bench_phase(double *t, int n, size_t size, BenchPhase *ph) {
+    qsort(t, (size_t)n, sizeof(*t), cmp_double);
+    ph->p50 = percentile(t, n, 50) * 1e3;
+    ph->p90 = percentile(t, n, 90) * 1e3;
+    ph->p99 = percentile(t, n, 99) * 1e3;
+    ph->mbps = ph->p50 > 0 ? (double)size / 1e6 / (ph->p50 / 1e3) : 0;
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') printf("\\%c", ch);
+        else if (ch < 0x20) printf("\\u%04x", ch);
+        else putchar(ch);
+    }
+    putchar('"');
+}
+
+/* A CSV field as RFC 4180 quotes one: in double quotes, each of its own
+   doubled, so commas and line breaks in file names stay in the field */
+static void print_csv_string(const char *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"') putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void bench_run(const BenchInput *bi, const Options *opt, int iterations, int format, int first) {
+    HuffCCtx *cctx = huff_cctx_create(&opt->enc);
+    HuffDCtx *dctx = huff_dctx_create();
+    size_t cap = huff_compress_bound(bi->size, &opt->enc);
+    uint8_t *comp = (uint8_t*)malloc(cap);
+    uint8_t *back = (uint8_t*)malloc(bi->size ? bi->size : 1);
+    double *tc = (double*)malloc((size_t)iterations * sizeof(double));
+    double *td = (double*)malloc((size_t)iterations * sizeof(double));
+    if (!cctx || !dctx || !comp || !back || !tc || !td) die_msg(huff_error_string(HUF_ERR_MEMORY));
+
+    size_t clen = 0, dlen = 0;
+    for (int it = 0; it < iterations; ++it) {
+        double t0 = now_seconds();
+        int err = huff_compress_ctx(cctx, bi->data, bi->size, comp, cap, &clen);
+        double t1 = now_seconds();
+        if (err == HUF_OK) err = huff_decompress_ctx(dctx, comp, clen, back, bi->size, &dlen);
+        double t2 = now_seconds();
+        if (err != HUF_OK) die_msg(huff_error_string(err));
+        if (dlen != bi->size || memcmp(back, bi->data, bi->size) != 0) die_msg("Benchmark round trip mismatch.");
+        tc[it] = t1 - t0;
+        td[it] = t2 - t1;
+    }
+
+    BenchPhase c, d;
+    bench_phase(tc, iterations, bi->size, &c);
+    bench_phase(td, iterations, bi->size, &d);
+    double ratio = clen ? (double)bi->size / (double)clen : 0;
+    if (format == BENCH_JSON) {
+        printf("%s  {\"name\": ", first ? "" : ",\n");
+        print_json_string(bi->name);
+        printf(", \"size\": %zu, \"compressed\": %zu, \"ratio\": %.4f, "
+               "\"compress_mbps\": %.1f, \"compress_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}, "
+               "\"decompress_mbps\": %.1f, \"decompress_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}}",
+               bi->size, clen, ratio,
+               c.mbps, c.p50, c.p90, c.p99, d.mbps, d.p50, d.p90, d.p99);
+    } else {
+        print_csv_string(bi->name);
+        printf(",%zu,%zu,%.4f,%.1f,%.3f,%.3f,%.3f,%.1f,%.3f,%.3f,%.3f\n",
+               bi->size, clen, ratio,
+               c.mbps, c.p50, c.p90, c.p99, d.mbps, d.p50, d.p90, d.p99);
+    }
+    free(td);
+    free(tc);
+    free(back);
+    free(comp);
+    huff_dctx_free(dctx);
+    huff_cctx_free(cctx);
+}
+
+static void bench(const char *const *files, int nfiles, const Options *opt, int iterations, int format) {
+    static const char *const corpus[] = { "text", "binary", "random", "single", "skewed" };
+    int n = nfiles ? nfiles : (int)(sizeof(corpus) / sizeof(corpus[0]));
+
+    if (format == BENCH_JSON) {
+        printf("{\"block_size\": %zu, \"max_code_len\": %d, \"streams\": %d, \"order1\": %d, \"transforms\": %d,\n"
+               " \"adaptive\": %d, \"iterations\": %d, \"results\": [\n", opt->enc.block_size,
+               opt->enc.max_code_len, opt->enc.streams, opt->enc.order1, opt->enc.transforms,
+               opt->enc.adaptive, iterations);
+    } else {
+        printf("name,size,compressed,ratio,compress_mbps,compress_ms_p50,compress_ms_p90,compress_ms_p99,"
+               "decompress_mbps,decompress_ms_p50,decompress_ms_p90,decompress_ms_p99\n");
+    }
+    for (int i = 0; i < n; ++i) {
+        BenchInput bi;
+        uint8_t *owned = NULL;
+        Input in;
+        FILE *f = NULL;
+        if (nfiles) {
+            f = open_input(files[i]);
+            input_init(&in, f, opt->use_mmap);
+            bi.name = files[i];
+            bi.data = (uint8_t*)input_read_all(&in, NULL, 0, &bi.size, &owned);
+        } else {
+            bi.name = corpus[i];
+            bi.size = BENCH_CORPUS_SIZE;
+            bi.data = owned = (uint8_t*)malloc(bi.size);
+            if (!owned) die("malloc");
+            bench_fill(bi.name, bi.data, bi.size);
+        }
+        bench_run(&bi, opt, iterations, format, i == 0);
+        fflush(stdout);
+        free(owned);
+        if (f) {
+            input_free(&in);
+            close_input(f);
+        }
+    }
+    if (format == BENCH_JSON) printf("\n ]}\n");
+}
+
+/* -------------------- Batch -------------------- */
+
+/* --batch: many files in one process, for corpora where starting the tool
+   per file costs more than coding it. Workers take the next file from a
+   shared counter and keep their context, decode tables and buffers from
+   one file to the next. Files go through the in-memory API rather than
+   the streaming paths, so a bad file is recorded and skipped instead of
+   ending the run; HUF1 files are left to the single-file -d. */
+typedef struct {
+    const char *in;
+    char *out;
+    const char *fail;  /* NULL, or why the file was not coded */
+    int sys_err;       /* errno behind fail, or 0 */
+    uint64_t size_in, size_out;
+    double seconds;
+} BatchFile;
+
+typedef struct {
+    pthread_mutex_t mu;
+    BatchFile *files;
+    size_t nfiles, next;
+    const Options *opt;
+    int compress;
+} BatchPool;
+
+/* What one worker keeps between files */
+typedef struct {
+    HuffCCtx *cctx;
+    HuffDCtx *dctx;
+    uint8_t *in, *out;
+    size_t in_cap, out_cap;
+} BatchScratch;
+
+static int batch_reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 1;
+    size_t want = *cap ? *cap : 1 << 16;
+    while (want < need) want = want > SIZE_MAX / 2 ? need : want * 2;
+    uint8_t *p = (uint8_t*)realloc(*buf, want);
+    if (!p) return 0;
+    *buf = p;
+    *cap = want;
+    return 1;
+}
+
+/* Read a whole file into s->in; 0 with fail set on error */
+static int batch_read(BatchFile *bf, BatchScratch *s, size_t *len) {
+    int fd = open(bf->in, O_RDONLY);
+    if (fd < 0) {
+        bf->fail = "open input";
+        bf->sys_err = errno;
+        return 0;
+    }
+    struct stat sb;
+    size_t n = 0, hint = fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) ? (size_t)sb.st_size + 1 : 1 << 16;
+    for (;;) {
+        if (!batch_reserve(&s->in, &s->in_cap, n + (n < hint ? hint - n : n))) {
+            bf->fail = huff_error_string(HUF_ERR_MEMORY);
+            break;
+        }
+        ssize_t got = read(fd, s->in + n, s->in_cap - n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            bf->fail = "read";
+            bf->sys_err = errno;
+            break;
+        }
+        if (got == 0) {
+            close(fd);
+            *len = n;
+            return 1;
+        }
+        n += (size_t)got;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Write buf[0..n) as the output file; a partial output is removed */
+static int batch_write(BatchFile *bf, const uint8_t *buf, size_t n) {
+    int fd = open(bf->out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        bf->fail = "open output";
+        bf->sys_err = errno;
+        return 0;
+    }
+    size_t done = 0;
+    while (done < n) {
+        ssize_t put = write(fd, buf + done, n - done);
+        if (put < 0 && errno == EINTR) continue;
+        if (put < 0) break;
+        done += (size_t)put;
+    }
+    if (done < n || close(fd) != 0) {
+        if (done < n) close(fd);
+        bf->fail = "write";
+        bf->sys_err = errno;
+        unlink(bf->out);
+        return 0;
+    }
+    return 1;
+}
+
+static void batch_code(BatchFile *bf, BatchScratch *s, const Options *opt, int compress) {
+    size_t n, got = 0;
+    if (!batch_read(bf, s, &n)) return;
+    bf->size_in = n;
+    int err;
+    if (compress) {
+        size_t cap = opt->dict ? huff_dict_compress_bound(opt->dict, n) : huff_compress_bound(n, &opt->enc);
+        if (!batch_reserve(&s->out, &s->out_cap, cap)) {
+            err = HUF_ERR_MEMORY;
+        } else if (opt->dict) {
+            err = huff_compress_dict(opt->dict, s->in, n, s->out, cap, &got);
+        } else {
+            err = huff_compress_ctx(s->cctx, s->in, n, s->out, cap, &got);
+        }
+    } else {
+        uint64_t size;
+        uint32_t id;
+        int dict = huff_get_dict_id(s->in, n, &id) == HUF_OK;
+        err = huff_decompressed_size(s->in, n, &size);
+        if (err == HUF_OK && dict && !opt->dict) {
+            err = HUF_ERR_DICTIONARY;
+        } else if (err == HUF_OK && (size > SIZE_MAX || !batch_reserve(&s->out, &s->out_cap, (size_t)size + 1))) {
+            err = HUF_ERR_MEMORY;
+        } else if (err == HUF_OK && dict) {
+            err = huff_decompress_dict(opt->dict, s->in, n, s->out, (size_t)size, &got);
+        } else if (err == HUF_OK) {
+            err = huff_decompress_ctx(s->dctx, s->in, n, s->out, (size_t)size, &got);
+        }
+    }
+    if (err != HUF_OK) {
+        bf->fail = huff_error_string(err);
+        return;
+    }
+    if (batch_write(bf, s->out, got)) bf->size_out = got;
+}
+
+static void *batch_worker(void *arg) {
+    BatchPool *p = (BatchPool*)arg;
+    BatchScratch s;
+    memset(&s, 0, sizeof(s));
+    s.cctx = huff_cctx_create(&p->opt->enc);
+    s.dctx = huff_dctx_create();
+    for (;;) {
+        pthread_mutex_lock(&p->mu);
+        size_t i = p->next < p->nfiles ? p->next++ : p->nfiles;
+        pthread_mutex_unlock(&p->mu);
+        if (i == p->nfiles) break;
+
+        BatchFile *bf = &p->files[i];
+        double t0 = now_seconds();
+        if (!s.cctx || !s.dctx) {
+            bf->fail = huff_error_string(HUF_ERR_MEMORY);
+        } else if (!bf->out) {
+            bf->fail = "No output name: the input does not end in .huf";
+        } else {
+            batch_code(bf, &s, p->opt, p->compress);
+        }
+        bf->seconds = now_seconds() - t0;
+    }
+    huff_cctx_free(s.cctx);
+    huff_dctx_free(s.dctx);
+    free(s.in);
+    free(s.out);
+    return NULL;
+}
+
+/* Split the list into files: one per non-empty line, an input path and
+   optionally a tab and the output path. Default outputs are the input
+   plus .huf for -c, and the input less .huf for -d. */
+static BatchFile *batch_parse(char *list, size_t len, int compress, size_t *nfiles) {
+    size_t cap = 0, n = 0;
+    BatchFile *files = NULL;
+    for (char *line = list; line < list + len;) {
+        char *end = (char*)memchr(line, '\n', (size_t)(list + len - line));
+        if (!end) end = list + len;
+        char *next = end + 1;
+        if (end > line && end[-1] == '\r') --end;
+        *end = '\0';
+        if (end > line) {
+            if (n == cap) {
+                cap = cap ? 2 * cap : 256;
+                files = (BatchFile*)realloc(files, cap * sizeof(*files));
+                if (!files) die("realloc");
+            }
+            BatchFile *bf = &files[n++];
+            memset(bf, 0, sizeof(*bf));
+            bf->in = line;
+            char *tab = strchr(line, '\t');
+            size_t in_len = tab ? (size_t)(tab - line) : (size_t)(end - line);
+            if (tab) {
+                *tab = '\0';
+                bf->out = strdup(tab + 1);
+            } else if (compress) {
+                bf->out = (char*)malloc(in_len + 5);
+                if (bf->out) {
+                    memcpy(bf->out, line, in_len);
+                    memcpy(bf->out + in_len, ".huf", 5);
+                }
+            } else if (in_len > 4 && strcmp(line + in_len - 4, ".huf") == 0) {
+                bf->out = strndup(line, in_len - 4);
+            }
+            if ((tab || compress) && !bf->out) die("malloc");
+        }
+        line = next;
+    }
+    *nfiles = n;
+    return files;
+}
+
+static void batch_report_line(FILE *f, const BatchFile *bf) {
+    fprintf(f, "%s\t%s\t%s\t%llu\t%llu\t%.3f\t", bf->fail ? "error" : "ok", bf->in, bf->out ? bf->out : "",
+            (unsigned long long)bf->size_in, (unsigned long long)bf->size_out, bf->seconds * 1e3);
+    if (bf->fail && bf->sys_err) {
+        fprintf(f, "%s: %s", bf->fail, strerror(bf->sys_err));
+    } else if (bf->fail) {
+        fputs(bf->fail, f);
+    }
+    fputc('\n', f);
+}
+
+/* Code every file in the list on opt->threads workers. The report, if
+   asked for, has one tab-separated line per file in list order; failures
+   also go to stderr, and the totals always do. Returns the failure count. */
+static size_t batch_run(const char *list_path, const char *report_path, const Options *opt, int compress) {
+    FILE *f = open_input(list_path);
+    Input in;
+    input_init(&in, f, 0);
+    size_t len;
+    uint8_t *owned;
+    const uint8_t *data = input_read_all(&in, NULL, 0, &len, &owned);
+    char *list = (char*)malloc(len + 1);
+    if (!list) die("malloc");
+    memcpy(list, data, len);
+    list[len] = '\0';
+    free(owned);
+    input_free(&in);
+    close_input(f);
+
+    BatchPool p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.mu, NULL);
+    p.files = batch_parse(list, len, compress, &p.nfiles);
+    p.opt = opt;
+    p.compress = compress;
+
+    double t0 = now_seconds();
+    int threads = (size_t)opt->threads < p.nfiles ? opt->threads : (int)p.nfiles;
+    pthread_t workers[MAX_THREADS];
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i], NULL, batch_worker, &p) != 0) die_msg("pthread_create failed.");
+    }
+    for (int i = 0; i < threads; ++i) pthread_join(workers[i], NULL);
+    double seconds = now_seconds() - t0;
+
+    FILE *report = report_path ? open_output(report_path) : NULL;
+    if (report) fputs("status\tinput\toutput\tbytes_in\tbytes_out\tms\tmessage\n", report);
+    size_t failed = 0;
+    uint64_t total_in = 0, total_out = 0;
+    for (size_t i = 0; i < p.nfiles; ++i) {
+        const BatchFile *bf = &p.files[i];
+        if (report) batch_report_line(report, bf);
+        if (bf->fail) {
+            failed++;
+            fprintf(stderr, "%s: %s%s%s\n", bf->in, bf->fail, bf->sys_err ? ": " : "",
+                    bf->sys_err ? strerror(bf->sys_err) : "");
+        } else {
+            total_in += bf->size_in;
+            total_out += bf->size_out;
+        }
+    }
+    if (report) close_output(report);
+    fprintf(stderr, "%zu files, %zu failed: %llu -> %llu bytes in %.3f s\n", p.nfiles, failed,
+            (unsigned long long)total_in, (unsigned long long)total_out, seconds);
+
+    for (size_t i = 0; i < p.nfiles; ++i) free(p.files[i].out);
+    free(p.files);
+    free(list);
+    pthread_mutex_destroy(&p.mu);
+    return failed;
+}
+
+/* -------------------- CLI -------------------- */
+
+/* Largest block size <= block_size whose input buffer plus worst-case
+   encoded buffer fit in mem bytes */
+static size_t block_size_for_memory(size_t block_size, int adaptive, uint64_t mem) {
+    while (block_size >= MIN_BLOCK_SIZE && block_size + split_bound(block_size, adaptive) > mem) {
+        size_t fit = (size_t)(mem / 2);
+        block_size = fit < block_size ? fit : block_size - 1;
+    }
+    if (block_size < MIN_BLOCK_SIZE) die_msg("--block-mem is too small for the minimum 1K block.");
+    return block_size;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s [options] -c <input> <output.huf>   Compress\n"
+        "  %s [options] -d <input.huf> <output>   Decompress\n"
+        "  %s [options] -d -r <off>:<len> <input.huf> <output>\n"
+        "                                          Decompress len bytes from off\n"
+        "  %s [options] -c --append <input> <archive.huf>\n"
+        "                                          Add input to the end of an\n"
+        "                                          archive as new blocks (or\n"
+        "                                          create it) and a new index;\n"
+        "                                          blocks are no larger than the\n"
+        "                                          archive's, and a failed run\n"
+        "                                          leaves it as it was\n"
+        "  %s [options] -c|-d --batch <list>     Code every file named in list,\n"
+        "                                          one per line (- for stdin, e.g.\n"
+        "                                          from find); a tab and a path\n"
+        "                                          after a name sets its output,\n"
+        "                                          else <name>.huf / <name> less\n"
+        "                                          .huf. -j sets the worker count.\n"
+        "  %s [options] --train <out.dict> <sample>...\n"
+        "                                          Build a dictionary from samples\n"
+        "  %s [options] --bench [<file>...]        Time in-memory coding of the\n"
+        "                                          files, or of a built-in corpus\n"
+        "  Either path may be - for stdin/stdout. HUF3 files joined with cat\n"
+        "  decompress to their inputs joined.\n"
+        "\n"
+        "Options:\n"
+        "  --buffer-size <n>   Decoder output buffer in bytes, K/M suffix allowed\n"
+        "                      (default 256K)\n"
+        "  --max-code-len <n>  Longest Huffman code the encoder may emit, 8..32\n"
+        "                      (default 11)\n"
+        "  --block-size <n>    Input block size, each block with its own table,\n"
+        "                      1K..256M (default 1M); 0 writes a single HUF2 stream\n"
+        "  --block-mem <n>     Cap the memory of one in-flight block (input plus\n"
+        "                      worst-case output); lowers the block size to fit\n"
+        "  -j <n>              Code blocks on n worker threads (default 1)\n"
+        "  --pipeline          Read, code and write blocks on separate threads so\n"
+        "                      I/O overlaps coding even without -j\n"
+        "                      -j and --pipeline apply to HUF3 only: HUF1/HUF2\n"
+        "                      input and --dict messages use one thread\n"
+        "  --checksum          Store a CRC32C with every block\n"
+        "  --order1            Code blocks with tables picked by the previous\n"
+        "                      byte where that is smaller (slower both ways)\n"
+        "  --transform <list>  Passes to try on each block before coding, kept\n"
+        "                      where they pay off: rle, lz77, both comma-\n"
+        "                      separated, or none (default)\n"
+        "  --adaptive          Cut blocks shorter where the byte statistics\n"
+        "                      shift enough to pay for another table\n"
+        "  --verify            Check block checksums while decompressing\n"
+        "  --mem <n>           -d: decode within n bytes, all reserved up front\n"
+        "                      (reported on stderr) with no mapping and no\n"
+        "                      allocation after; fails at once if the file's\n"
+        "                      blocks need more (or, for files joined with\n"
+        "                      cat, at one with larger blocks than the first)\n"
+        "  --stats             Report per-phase times, sizes, entropy and code\n"
+        "                      lengths on stderr\n"
+        "  --no-mmap           Read and write regular files with stdio instead\n"
+        "                      of mapping them\n"
+        "  --streams <1|4>     Bitstreams per block; 4 lets the decoder work on\n"
+        "                      four independent streams at once (default 4)\n"
+        "  --decoder <kind>    Table decoder: single (one symbol per lookup) or\n"
+        "                      multi (up to 3 short codes per lookup, default)\n"
+        "  --dict <file>       Code against a dictionary from --train: no count\n"
+        "                      pass and no table in the output, for small inputs\n"
+        "  --iterations <n>    --bench: runs per input (default 5)\n"
+        "  --format <fmt>      --bench: csv (default) or json, on stdout\n"
+        "  --report <file>     --batch: one tab-separated status line per file\n",
+        prog, prog, prog, prog, prog, prog, prog);
+}
+
+/* Parse a byte count such as "4096", "256K" or "8M" */
+static uint64_t parse_size(const char *s, const char *what) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s || *s == '-') goto bad;
+    int shift = 0;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: goto bad;
+    }
+    if (*end != '\0' || v > (UINT64_MAX >> shift)) goto bad;
+    return (uint64_t)v << shift;
+bad:
+    fprintf(stderr, "Invalid %s: %s\n", what, s);
+    exit(EXIT_FAILURE);
+}
+
+/* --transform: "none" or a comma-separated list of rle and lz77 */
+static int parse_transforms(const char *s) {
+    if (strcmp(s, "none") == 0) return 0;
+    int transforms = 0;
+    while (*s) {
+        size_t len = strcspn(s, ",");
+        if (len == 3 && strncmp(s, "rle", 3) == 0) {
+            transforms |= HUFF_TRANSFORM_RLE;
+        } else if (len == 4 && strncmp(s, "lz77", 4) == 0) {
+            transforms |= HUFF_TRANSFORM_LZ77;
+        } else {
+            die_msg("Transforms must be none or a list of rle and lz77.");
+        }
+        s += len;
+        if (*s == ',') s++;
+    }
+    if (!transforms) die_msg("Transforms must be none or a list of rle and lz77.");
+    return transforms;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    options_init(&opt);
+
+    const char *mode = NULL;
+    const char *dict_path = NULL;
+    const char *batch_path = NULL, *report_path = NULL;
+    uint64_t block_mem = 0;
+    int iterations = DEFAULT_BENCH_ITERATIONS;
+    int want_stats = 0;
+    int append = 0;
+    int format = BENCH_CSV;
+    const char **paths = (const char**)calloc((size_t)argc, sizeof(*paths));
+    if (!paths) die("calloc");
+    int npaths = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        if (strcmp(a, "-c") == 0 || strcmp(a, "-d") == 0 || strcmp(a, "--train") == 0 ||
+            strcmp(a, "--bench") == 0) {
+            if (mode) { usage(argv[0]); return EXIT_FAILURE; }
+            mode = a;
+        } else if (strcmp(a, "--buffer-size") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "buffer size");
+            if (v == 0 || v > ((uint64_t)1 << 30)) die_msg("Buffer size must be between 1 and 1G.");
+            opt.out_buf_size = (size_t)v;
+        } else if (strcmp(a, "--max-code-len") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "code length");
+            if (v < MIN_MAX_CODE_LEN || v > MAX_CODE_LEN) die_msg("Code length limit must be between 8 and 32.");
+            opt.enc.max_code_len = (int)v;
+        } else if (strcmp(a, "--block-size") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "block size");
+            if (v != 0 && (v < MIN_BLOCK_SIZE || v > MAX_BLOCK_SIZE)) {
+                die_msg("Block size must be 0 or between 1K and 256M.");
+            }
+            opt.enc.block_size = (size_t)v;
+        } else if (strcmp(a, "--streams") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "stream count");
+            if (v != 1 && v != 4) die_msg("Stream count must be 1 or 4.");
+            opt.enc.streams = (int)v;
+        } else if (strcmp(a, "--decoder") == 0 && i + 1 < argc) {
+            const char *d = argv[++i];
+            if (strcmp(d, "single") == 0) {
+                opt.decoder = DECODER_SINGLE;
+            } else if (strcmp(d, "multi") == 0) {
+                opt.decoder = DECODER_MULTI;
+            } else {
+                die_msg("Decoder must be single or multi.");
+            }
+        } else if (strcmp(a, "--iterations") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "iteration count");
+            if (v < 1 || v > 1000000) die_msg("Iteration count must be between 1 and 1000000.");
+            iterations = (int)v;
+        } else if (strcmp(a, "--format") == 0 && i + 1 < argc) {
+            const char *f = argv[++i];
+            if (strcmp(f, "csv") == 0) {
+                format = BENCH_CSV;
+            } else if (strcmp(f, "json") == 0) {
+                format = BENCH_JSON;
+            } else {
+                die_msg("Format must be csv or json.");
+            }
+        } else if (strcmp(a, "--dict") == 0 && i + 1 < argc) {
+            dict_path = argv[++i];
+        } else if (strcmp(a, "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(a, "--report") == 0 && i + 1 < argc) {
+            report_path = argv[++i];
+        } else if (strcmp(a, "--pipeline") == 0) {
+            opt.pipeline = 1;
+        } else if (strcmp(a, "--append") == 0) {
+            append = 1;
+        } else if (strcmp(a, "-r") == 0 && i + 1 < argc) {
+            const char *r = argv[++i];
+            const char *colon = strchr(r, ':');
+            if (!colon || colon == r) die_msg("Range must be offset:length.");
+            char off[32];
+            size_t olen = (size_t)(colon - r);
+            if (olen >= sizeof(off)) die_msg("Range must be offset:length.");
+            memcpy(off, r, olen);
+            off[olen] = '\0';
+            opt.range = 1;
+            opt.range_offset = parse_size(off, "range offset");
+            opt.range_length = parse_size(colon + 1, "range length");
+        } else if (strcmp(a, "--checksum") == 0) {
+            opt.enc.checksum = 1;
+        } else if (strcmp(a, "--order1") == 0) {
+            opt.enc.order1 = 1;
+        } else if (strcmp(a, "--adaptive") == 0) {
+            opt.enc.adaptive = 1;
+        } else if (strcmp(a, "--transform") == 0 && i + 1 < argc) {
+            opt.enc.transforms = parse_transforms(argv[++i]);
+        } else if (strcmp(a, "--verify") == 0) {
+            opt.verify = 1;
+        } else if (strcmp(a, "--stats") == 0) {
+            want_stats = 1;
+        } else if (strcmp(a, "--no-mmap") == 0) {
+            opt.use_mmap = 0;
+        } else if (strcmp(a, "--mem") == 0 && i + 1 < argc) {
+            opt.mem = parse_size(argv[++i], "memory cap");
+            if (opt.mem == 0) die_msg("Memory cap must be above 0.");
+        } else if (strcmp(a, "--block-mem") == 0 && i + 1 < argc) {
+            block_mem = parse_size(argv[++i], "block memory");
+        } else if (strcmp(a, "-j") == 0 && i + 1 < argc) {
+            uint64_t v = parse_size(argv[++i], "thread count");
+            if (v < 1 || v > MAX_THREADS) die_msg("Thread count must be between 1 and 256.");
+            opt.threads = (int)v;
+        } else if (a[0] == '-' && a[1] == '-') {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            paths[npaths++] = a;
+        }
+    }
+    int batch = batch_path && mode && (strcmp(mode, "-c") == 0 || strcmp(mode, "-d") == 0);
+    if ((batch_path && !batch) || (report_path && !batch)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (mode && strcmp(mode, "--train") == 0) {
+        if (npaths < 2 || dict_path) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        train_dict(paths[0], paths + 1, npaths - 1, opt.enc.max_code_len);
+        free(paths);
+        return EXIT_SUCCESS;
+    }
+    if (mode && strcmp(mode, "--bench") == 0) {
+        if (dict_path) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (block_mem) opt.enc.block_size = block_size_for_memory(opt.enc.block_size, opt.enc.adaptive, block_mem);
+        if (opt.enc.block_size == 0) die_msg("--bench needs block mode (--block-size > 0).");
+        bench(paths, npaths, &opt, iterations, format);
+        free(paths);
+        return EXIT_SUCCESS;
+    }
+    if (!mode || npaths != (batch ? 0 : 2)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (batch && (opt.range || opt.pipeline || want_stats)) die_msg("--batch does not take -r, --pipeline or --stats.");
+    if (batch && strcmp(mode, "-c") == 0 && opt.enc.block_size == 0 && !dict_path) {
+        die_msg("--batch compresses in block mode (--block-size > 0) or with --dict.");
+    }
+    if (strcmp(mode, "-c") == 0 && opt.threads > 1 && opt.enc.block_size == 0) {
+        die_msg("-j needs block mode (--block-size > 0).");
+    }
+    if (strcmp(mode, "-c") == 0 && opt.pipeline && opt.enc.block_size == 0) {
+        die_msg("--pipeline needs block mode (--block-size > 0).");
+    }
+    if (opt.range && strcmp(mode, "-d") != 0) die_msg("-r only applies to -d.");
+    if (opt.mem && (strcmp(mode, "-d") != 0 || batch)) die_msg("--mem only applies to -d.");
+    if (append && (strcmp(mode, "-c") != 0 || batch || dict_path)) {
+        die_msg("--append only applies to -c without --batch or --dict.");
+    }
+    if (append && opt.enc.block_size == 0) die_msg("--append needs block mode (--block-size > 0).");
+    if (append && strcmp(paths[1], "-") == 0) die_msg("--append needs an archive file, not stdout.");
+    if (opt.mem && (opt.threads > 1 || opt.pipeline || opt.range)) die_msg("--mem does not take -j, --pipeline or -r.");
+    if (opt.mem) opt.use_mmap = 0;
+    if (strcmp(mode, "-c") == 0 && (opt.enc.checksum || opt.enc.order1 || opt.enc.transforms || opt.enc.adaptive) &&
+        (opt.enc.block_size == 0 || dict_path)) {
+        die_msg("--checksum, --order1, --transform and --adaptive need block mode (--block-size > 0, no --dict).");
+    }
+    if (block_mem) {
+        if (opt.enc.block_size == 0) die_msg("--block-mem needs block mode (--block-size > 0).");
+        opt.enc.block_size = block_size_for_memory(opt.enc.block_size, opt.enc.adaptive, block_mem);
+    }
+    HuffDict *dict = dict_path ? load_dict(dict_path) : NULL;
+    opt.dict = dict;
+    if (batch) {
+        size_t failed = batch_run(batch_path, report_path, &opt, strcmp(mode, "-c") == 0);
+        huff_dict_free(dict);
+        free(paths);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    RunStats stats;
+    if (want_stats) {
+        memset(&stats, 0, sizeof(stats));
+        opt.stats = &stats;
+    }
+    int compress = strcmp(mode, "-c") == 0;
+    uint64_t t = stats_clock(opt.stats);
+    if (append) {
+        append_file(paths[0], paths[1], &opt);
+    } else if (compress) {
+        compress_file(paths[0], paths[1], &opt);
+    } else {
+        decompress_file(paths[0], paths[1], &opt);
+    }
+    if (opt.stats) {
+        stats.total_ns = huf_now_ns() - t;
+        print_stats(&stats, compress, opt.threads > 1 || opt.pipeline);
+    }
+    huff_dict_free(dict);
+    free(paths);
+    return EXIT_SUCCESS;
+}
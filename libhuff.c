@@ -0,0 +1,2586 @@
+/* libhuff.c
+ * The coding core shared by the huff tool and the in-memory API in huff.h:
+ * histogram, Huffman tree and canonical codes, decode tables and HUF3 block
+ * coding. Works on memory buffers only and reports errors as HUF_ERR_*
+ * codes; file handling lives in huffman.c.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "huff_internal.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_AVX2_HISTOGRAM 1
+#define HAVE_SSE42_CRC32C 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_HISTOGRAM 1
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32C 1
+#endif
+#endif
+
+/* -------------------- Histogram -------------------- */
+
+/* Byte counting with one table serializes on runs of equal bytes: every
+   increment waits for the store of the previous one. Spreading consecutive
+   bytes over four sub-tables breaks that chain; the tables are summed at
+   the end. The SIMD variants also add whole 32/16-byte runs of one value
+   with a single increment, which is what low-entropy logs mostly contain. */
+#define HIST_TABLES 4
+
+static inline void hist_count8(uint32_t t[HIST_TABLES][256], uint64_t w) {
+    t[0][w & 0xFF]++;
+    t[1][(w >> 8) & 0xFF]++;
+    t[2][(w >> 16) & 0xFF]++;
+    t[3][(w >> 24) & 0xFF]++;
+    t[0][(w >> 32) & 0xFF]++;
+    t[1][(w >> 40) & 0xFF]++;
+    t[2][(w >> 48) & 0xFF]++;
+    t[3][w >> 56]++;
+}
+
+static void hist_merge(uint32_t t[HIST_TABLES][256], uint32_t freq[256]) {
+    for (int i = 0; i < 256; ++i) {
+        freq[i] += t[0][i] + t[1][i] + t[2][i] + t[3][i];
+    }
+}
+
+static void histogram_scalar(const uint8_t *src, size_t n, uint32_t freq[256]) {
+    uint32_t t[HIST_TABLES][256];
+    memset(t, 0, sizeof(t));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        hist_count8(t, w);
+    }
+    for (; i < n; ++i) t[i & 3][src[i]]++;
+    hist_merge(t, freq);
+}
+
+#if defined(HAVE_AVX2_HISTOGRAM)
+__attribute__((target("avx2")))
+static void histogram_avx2(const uint8_t *src, size_t n, uint32_t freq[256]) {
+    uint32_t t[HIST_TABLES][256];
+    memset(t, 0, sizeof(t));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i first = _mm256_set1_epi8((char)src[i]);
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) == 0xFFFFFFFFu) {
+            t[0][src[i]] += 32;
+            continue;
+        }
+        for (int k = 0; k < 32; k += 8) {
+            uint64_t w;
+            memcpy(&w, src + i + k, 8);
+            hist_count8(t, w);
+        }
+    }
+    for (; i < n; ++i) t[i & 3][src[i]]++;
+    hist_merge(t, freq);
+}
+#elif defined(HAVE_NEON_HISTOGRAM)
+static void histogram_neon(const uint8_t *src, size_t n, uint32_t freq[256]) {
+    uint32_t t[HIST_TABLES][256];
+    memset(t, 0, sizeof(t));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        if (vminvq_u8(vceqq_u8(v, vdupq_n_u8(src[i]))) == 0xFF) {
+            t[0][src[i]] += 16;
+            continue;
+        }
+        for (int k = 0; k < 16; k += 8) {
+            uint64_t w;
+            memcpy(&w, src + i + k, 8);
+            hist_count8(t, w);
+        }
+    }
+    for (; i < n; ++i) t[i & 3][src[i]]++;
+    hist_merge(t, freq);
+}
+#endif
+
+static void (*histogram_impl)(const uint8_t *, size_t, uint32_t *) = histogram_scalar;
+static pthread_once_t histogram_once = PTHREAD_ONCE_INIT;
+
+static void histogram_select(void) {
+#if defined(HAVE_AVX2_HISTOGRAM)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) histogram_impl = histogram_avx2;
+#elif defined(HAVE_NEON_HISTOGRAM)
+    histogram_impl = histogram_neon;  /* NEON is baseline on AArch64 */
+#endif
+}
+
+void huf_histogram(const uint8_t *src, size_t n, uint32_t freq[256]) {
+    pthread_once(&histogram_once, histogram_select);
+    histogram_impl(src, n, freq);
+}
+
+/* -------------------- Checksum -------------------- */
+
+/* CRC32C (Castagnoli), which SSE4.2 and the ARMv8 CRC extension compute
+   eight bytes per instruction. The table fallback is slicing-by-8. */
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = load_le64(src + i) ^ crc;
+        crc = crc_table[7][w & 0xFF] ^ crc_table[6][(w >> 8) & 0xFF] ^
+              crc_table[5][(w >> 16) & 0xFF] ^ crc_table[4][(w >> 24) & 0xFF] ^
+              crc_table[3][(w >> 32) & 0xFF] ^ crc_table[2][(w >> 40) & 0xFF] ^
+              crc_table[1][(w >> 48) & 0xFF] ^ crc_table[0][w >> 56];
+    }
+    for (; i < n; ++i) crc = crc_table[0][(crc ^ src[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(HAVE_SSE42_CRC32C)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *src, size_t n) {
+    uint64_t c = crc;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; i < n; ++i) c32 = _mm_crc32_u8(c32, src[i]);
+    return c32;
+}
+#elif defined(HAVE_ARM_CRC32C)
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; i < n; ++i) crc = __crc32cb(crc, src[i]);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t) = crc32c_sw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_select(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; ++t) {
+        for (int i = 0; i < 256; ++i) {
+            uint32_t c = crc_table[t - 1][i];
+            crc_table[t][i] = crc_table[0][c & 0xFF] ^ (c >> 8);
+        }
+    }
+#if defined(HAVE_SSE42_CRC32C)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c_impl = crc32c_sse42;
+#elif defined(HAVE_ARM_CRC32C)
+    crc32c_impl = crc32c_arm;
+#endif
+}
+
+uint32_t huf_crc32c_update(uint32_t crc, const uint8_t *src, size_t n) {
+    pthread_once(&crc32c_once, crc32c_select);
+    return ~crc32c_impl(~crc, src, n);
+}
+
+uint32_t huf_crc32c(const uint8_t *src, size_t n) {
+    return huf_crc32c_update(0, src, n);
+}
+
+/* -------------------- Huffman Core -------------------- */
+
+/* Fixed storage for one tree: n leaves need n - 1 internal nodes */
+#define MAX_TREE_NODES (2 * 256 - 1)
+
+typedef struct {
+    Node nodes[MAX_TREE_NODES];
+} TreeArena;
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Two-queue construction: leaves are sorted once, then the two smallest of
+   {front of the leaf queue, front of the internal-node queue} are merged
+   repeatedly. Internal nodes are created in non-decreasing weight order, so
+   their queue stays sorted without any insertion. All nodes live in the
+   arena; nothing is allocated or freed. */
+static Node* build_huffman_tree_fast(const uint32_t freq[256], TreeArena *a) {
+    uint64_t keys[256];
+    int symbols = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] > 0) keys[symbols++] = ((uint64_t)freq[i] << 8) | (uint64_t)i;
+    }
+    if (symbols == 0) {
+        return NULL; /* empty file: no tree */
+    }
+    qsort(keys, (size_t)symbols, sizeof(keys[0]), cmp_u64);
+
+    Node *nodes = a->nodes;
+    for (int i = 0; i < symbols; ++i) {
+        Node *leaf = &nodes[i];
+        leaf->freq = (uint32_t)(keys[i] >> 8);
+        leaf->is_leaf = 1;
+        leaf->symbol = (uint16_t)(keys[i] & 0xFF);
+        leaf->left = leaf->right = NULL;
+    }
+    if (symbols == 1) {
+        /* Special: single symbol; create a parent to ensure at least one bit */
+        Node *root = &nodes[1];
+        root->freq = nodes[0].freq;
+        root->is_leaf = 0;
+        root->symbol = 0;
+        root->left = &nodes[0];
+        root->right = NULL;
+        return root;
+    }
+
+    int leaf_head = 0;             /* next unused leaf */
+    int inner_head = symbols;      /* next unused internal node */
+    int next = symbols;            /* next free slot */
+    while (next < 2 * symbols - 1) {
+        Node *pick[2];
+        for (int k = 0; k < 2; ++k) {
+            if (leaf_head < symbols &&
+                (inner_head == next || nodes[leaf_head].freq <= nodes[inner_head].freq)) {
+                pick[k] = &nodes[leaf_head++];
+            } else {
+                pick[k] = &nodes[inner_head++];
+            }
+        }
+        Node *parent = &nodes[next++];
+        parent->freq = pick[0]->freq + pick[1]->freq;
+        parent->is_leaf = 0;
+        parent->symbol = 0;
+        parent->left = pick[0];
+        parent->right = pick[1];
+    }
+    return &nodes[next - 1];
+}
+
+static void code_lengths_dfs(Node *n, uint8_t lens[256], uint8_t depth) {
+    if (!n) return;
+    if (n->is_leaf) {
+        lens[n->symbol] = depth ? depth : 1; /* ensure at least 1-bit code */
+        return;
+    }
+    code_lengths_dfs(n->left,  lens, depth + 1);
+    code_lengths_dfs(n->right, lens, depth + 1);
+}
+
+/* Code length of every byte = depth of its leaf (0 for unused bytes) */
+static void build_code_lengths(Node *root, uint8_t lens[256]) {
+    memset(lens, 0, 256);
+    if (root) code_lengths_dfs(root, lens, 0);
+}
+
+/* Assign canonical codes: shorter codes first, ties broken by symbol value.
+   Only the lengths need to be stored for the decoder to rebuild them. */
+void huf_assign_canonical_codes(const uint8_t lens[256], Code table[256]) {
+    uint32_t count[MAX_CODE_LEN + 1] = {0};
+    for (int i = 0; i < 256; ++i) {
+        if (lens[i]) count[lens[i]]++;
+    }
+    uint64_t next[MAX_CODE_LEN + 1];
+    uint64_t code = 0;
+    next[0] = 0;
+    for (int len = 1; len <= MAX_CODE_LEN; ++len) {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (int i = 0; i < 256; ++i) {
+        table[i].len = lens[i];
+        table[i].code = lens[i] ? (uint32_t)next[lens[i]]++ : 0;
+    }
+}
+
+/* Non-zero if the lengths describe a usable prefix code */
+int huf_code_lengths_valid(const uint8_t lens[256]) {
+    uint64_t kraft = 0;
+    int symbols = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (!lens[i]) continue;
+        if (lens[i] > MAX_CODE_LEN) return 0;
+        kraft += (uint64_t)1 << (MAX_CODE_LEN - lens[i]);
+        symbols++;
+    }
+    return symbols > 0 && kraft <= ((uint64_t)1 << MAX_CODE_LEN);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Clamp code lengths to max_len while keeping a complete prefix code.
+   Lengths past the limit are cut to max_len, which over-subscribes the code
+   space; slots are then won back one at a time by lengthening the deepest
+   code that is still shorter than max_len (as in zlib/miniz). Finally the
+   adjusted lengths are handed out again in the original depth order, so
+   frequent symbols keep the short codes. */
+static void limit_code_lengths(uint8_t lens[256], int max_len) {
+    uint32_t count[256] = {0};
+    uint32_t order[256];
+    int symbols = 0, longest = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (!lens[i]) continue;
+        count[lens[i]]++;
+        if (lens[i] > longest) longest = lens[i];
+        order[symbols++] = ((uint32_t)lens[i] << 8) | (uint32_t)i;
+    }
+    if (longest <= max_len) return;
+
+    for (int len = max_len + 1; len <= longest; ++len) {
+        count[max_len] += count[len];
+        count[len] = 0;
+    }
+    uint64_t total = 0;
+    for (int len = 1; len <= max_len; ++len) {
+        total += (uint64_t)count[len] << (max_len - len);
+    }
+    while (total > ((uint64_t)1 << max_len)) {
+        count[max_len]--;
+        for (int len = max_len - 1; len > 0; --len) {
+            if (count[len]) {
+                count[len]--;
+                count[len + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    qsort(order, (size_t)symbols, sizeof(order[0]), cmp_u32);
+    int k = 0;
+    for (int len = 1; len <= max_len; ++len) {
+        for (uint32_t c = 0; c < count[len]; ++c) {
+            lens[order[k++] & 0xFF] = (uint8_t)len;
+        }
+    }
+}
+
+void huf_build_code_table(const uint32_t freq[256], Code table[256], int max_len) {
+    TreeArena arena;
+    Node *root = build_huffman_tree_fast(freq, &arena);
+    uint8_t lens[256];
+    build_code_lengths(root, lens);
+    limit_code_lengths(lens, max_len);
+    huf_assign_canonical_codes(lens, table);
+}
+
+void huf_normalize_counts(const uint64_t counts[256], uint32_t freq[256]) {
+    uint64_t total = 0;
+    for (int i = 0; i < 256; ++i) total += counts[i];
+    /* below 2^31 after the shift, so the bumps to 1 cannot reach 2^32 */
+    int shift = 0;
+    while ((total >> shift) >= ((uint64_t)1 << 31)) shift++;
+    for (int i = 0; i < 256; ++i) {
+        uint64_t f = counts[i] >> shift;
+        freq[i] = (uint32_t)(f == 0 && counts[i] != 0 ? 1 : f);
+    }
+}
+
+/* -------------------- Code Length Table -------------------- */
+
+/* Serialize code lengths in whichever encoding is smaller. Returns bytes written. */
+size_t huf_pack_code_lengths(const uint8_t lens[256], uint8_t *dst) {
+    int symbols = 0, max_len = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (!lens[i]) continue;
+        symbols++;
+        if (lens[i] > max_len) max_len = lens[i];
+    }
+    if (symbols == 0) {
+        dst[0] = CL_NONE;
+        return 1;
+    }
+    size_t sparse = 2 + 2 * (size_t)symbols;
+    if (max_len <= 15 && 1 + 128 < sparse) {
+        dst[0] = CL_PACKED;
+        for (int i = 0; i < 128; ++i) {
+            dst[1 + i] = (uint8_t)((lens[2 * i] << 4) | lens[2 * i + 1]);
+        }
+        return 1 + 128;
+    }
+    size_t n = 0;
+    dst[n++] = CL_SPARSE;
+    dst[n++] = (uint8_t)(symbols - 1);
+    for (int i = 0; i < 256; ++i) {
+        if (!lens[i]) continue;
+        dst[n++] = (uint8_t)i;
+        dst[n++] = lens[i];
+    }
+    return n;
+}
+
+/* Bytes needed to finish a code length table, given the first `have`
+   bytes of it (so a stream reader knows how much more to fetch). */
+size_t huf_code_lengths_size(const uint8_t *src, size_t have) {
+    if (have < 1) return 1;
+    switch (src[0]) {
+        case CL_NONE:   return 1;
+        case CL_PACKED: return 1 + 128;
+        case CL_SPARSE: return have < 2 ? 2 : 2 + 2 * ((size_t)src[1] + 1);
+        default:        return 0;
+    }
+}
+
+/* Parse a table written by huf_pack_code_lengths. Returns bytes consumed,
+   or 0 if it is truncated or malformed. Lengths are not checked for
+   validity. */
+size_t huf_unpack_code_lengths(const uint8_t *src, size_t avail, uint8_t lens[256]) {
+    memset(lens, 0, 256);
+    size_t need = huf_code_lengths_size(src, avail);
+    if (need == 0 || need > avail) return 0;
+    if (src[0] == CL_PACKED) {
+        for (int i = 0; i < 128; ++i) {
+            lens[2 * i] = src[1 + i] >> 4;
+            lens[2 * i + 1] = src[1 + i] & 0x0F;
+        }
+    } else if (src[0] == CL_SPARSE) {
+        size_t symbols = (size_t)src[1] + 1;
+        for (size_t k = 0; k < symbols; ++k) {
+            uint8_t sym = src[2 + 2 * k];
+            if (lens[sym] || !src[3 + 2 * k]) return 0; /* duplicate or zero */
+            lens[sym] = src[3 + 2 * k];
+        }
+    }
+    return need;
+}
+
+/* -------------------- Bit Reader -------------------- */
+
+static void br_fill_buffer(BitReader *br) {
+    size_t rest = br->len - br->pos;
+    memmove(br->buf, br->buf + br->pos, rest);
+    br->pos = 0;
+    br->len = rest;
+    size_t got = fread(br->buf + rest, 1, BIT_IO_BUF_SIZE - rest, br->f);
+    if (got == 0) br->eof = 1;
+    br->len += got;
+}
+
+/* Top up the accumulator to at least 57 bits unless the input is exhausted.
+   Bits past EOF read as zero but are not counted in br->bits. */
+static inline void br_refill(BitReader *br) {
+    if (br->bits > 56) return;
+    if (br->len - br->pos < 8 && !br->eof) br_fill_buffer(br);
+    if (br->len - br->pos >= 8) {
+        /* Whole-word load; bits beyond the consumed bytes are ORed in again
+           by the next refill at the same position, which is harmless. */
+        br->acc |= load_be64(br->buf + br->pos) >> br->bits;
+        int nbytes = (63 - br->bits) >> 3;
+        br->pos += (size_t)nbytes;
+        br->bits += nbytes * 8;
+    } else {
+        while (br->bits <= 56 && br->pos < br->len) {
+            br->acc |= (uint64_t)br->buf[br->pos++] << (56 - br->bits);
+            br->bits += 8;
+        }
+    }
+}
+
+/* Look at the next n bits (1..32) without consuming them */
+static inline uint32_t br_peek_bits(const BitReader *br, int n) {
+    return (uint32_t)(br->acc >> (64 - n));
+}
+
+static inline void br_skip_bits(BitReader *br, int n) {
+    br->acc <<= n;
+    br->bits -= n;
+}
+
+/* -------------------- Decode Table -------------------- */
+
+static void multi_table_build(DecodeTable *dt, uint32_t *m) {
+    int root_bits = dt->root_bits;
+    size_t size = (size_t)1 << root_bits;
+    uint32_t mask = (uint32_t)size - 1u;
+    for (uint32_t idx = 0; idx < size; ++idx) {
+        uint32_t packed = 0;
+        int used = 0, count = 0;
+        while (count < MULTI_MAX_SYMS) {
+            /* zeros shifted in at the bottom never decide a code that fits */
+            const DecodeEntry *e = &dt->entries[(idx << used) & mask];
+            if (e->kind != DE_SYMBOL || e->len > root_bits - used) break;
+            packed |= e->value << (8 * count);
+            used += e->len;
+            count++;
+        }
+        m[idx] = packed | ((uint32_t)used << 24) | ((uint32_t)count << 29);
+    }
+    dt->multi = m;
+}
+
+void huf_decode_table_init(DecodeTable *dt) {
+    memset(dt, 0, sizeof(*dt));
+}
+
+/* Rebuild dt for table, growing its storage only when the new table needs
+   more entries than any before. Returns HUF_OK, HUF_ERR_CORRUPT for codes
+   over MAX_CODE_LEN bits, or HUF_ERR_MEMORY. */
+int huf_decode_table_build(DecodeTable *dt, const Code table[256], int multi) {
+    int max_len = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (table[i].len > max_len) max_len = table[i].len;
+    }
+    if (max_len > MAX_CODE_LEN) return HUF_ERR_CORRUPT;
+
+    int root_bits = max_len < DECODE_ROOT_BITS ? max_len : DECODE_ROOT_BITS;
+    if (root_bits == 0) root_bits = 1;
+    size_t root_size = (size_t)1 << root_bits;
+
+    /* Size each subtable by the longest code sharing its root prefix */
+    uint8_t sub_bits[1u << DECODE_ROOT_BITS] = {0};
+    for (int i = 0; i < 256; ++i) {
+        int len = table[i].len;
+        if (len <= root_bits) continue;
+        uint32_t prefix = table[i].code >> (len - root_bits);
+        if (len - root_bits > sub_bits[prefix]) sub_bits[prefix] = (uint8_t)(len - root_bits);
+    }
+    size_t total = root_size;
+    for (size_t p = 0; p < root_size; ++p) {
+        if (sub_bits[p]) total += (size_t)1 << sub_bits[p];
+    }
+
+    if (total > dt->cap) {
+        if (dt->fixed) return HUF_ERR_MEMORY;
+        DecodeEntry *grown = (DecodeEntry*)realloc(dt->entries, total * sizeof(DecodeEntry));
+        if (!grown) return HUF_ERR_MEMORY;
+        dt->entries = grown;
+        dt->cap = total;
+    }
+    DecodeEntry *e = dt->entries;
+    memset(e, 0, total * sizeof(DecodeEntry));
+    size_t next = root_size;
+    for (size_t p = 0; p < root_size; ++p) {
+        if (!sub_bits[p]) continue;
+        e[p].value = (uint32_t)next;
+        e[p].len = sub_bits[p];
+        e[p].kind = DE_LINK;
+        next += (size_t)1 << sub_bits[p];
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        int len = table[i].len;
+        if (len == 0) continue;
+        uint32_t code = table[i].code;
+        DecodeEntry *dst;
+        int free_bits;
+        if (len <= root_bits) {
+            free_bits = root_bits - len;
+            dst = &e[(size_t)code << free_bits];
+        } else {
+            int rest = len - root_bits;
+            uint32_t prefix = code >> rest;
+            free_bits = e[prefix].len - rest;
+            uint32_t low = code & ((1u << rest) - 1u);
+            dst = &e[e[prefix].value + ((size_t)low << free_bits)];
+        }
+        for (size_t k = 0; k < ((size_t)1 << free_bits); ++k) {
+            dst[k].value = (uint32_t)i;
+            dst[k].len = (uint8_t)len;
+            dst[k].kind = DE_SYMBOL;
+        }
+    }
+
+    dt->multi = NULL;
+    dt->root_bits = root_bits;
+    if (multi) {
+        if (!dt->multi_buf) {
+            dt->multi_buf = (uint32_t*)malloc(((size_t)1 << DECODE_ROOT_BITS) * sizeof(uint32_t));
+            if (!dt->multi_buf) return HUF_ERR_MEMORY;
+        }
+        multi_table_build(dt, dt->multi_buf);
+    }
+    return HUF_OK;
+}
+
+void huf_decode_table_free(DecodeTable *dt) {
+    if (dt->fixed) {
+        huf_decode_table_init(dt);
+        return;
+    }
+    free(dt->entries);
+    free(dt->multi_buf);
+    if (dt->order1) {
+        for (int i = 0; i < ORDER1_MAX_TABLES; ++i) huf_decode_table_free(&dt->order1[i]);
+        free(dt->order1);
+    }
+    free(dt->work[0]);
+    free(dt->work[1]);
+    huf_decode_table_init(dt);
+}
+
+/* Transform buffer k of dt with room for n bytes, or NULL */
+static uint8_t *decode_work(DecodeTable *dt, int k, size_t n) {
+    if (n > dt->work_cap[k]) {
+        if (dt->fixed) return NULL;
+        uint8_t *grown = (uint8_t*)realloc(dt->work[k], n);
+        if (!grown) return NULL;
+        dt->work[k] = grown;
+        dt->work_cap[k] = n;
+    }
+    return dt->work[k];
+}
+
+/* Decode one symbol. Returns the symbol, HUF_ERR_TRUNCATED if the input
+   ran out, or HUF_ERR_CORRUPT for a bit pattern no code starts with. */
+static inline int decode_symbol(const DecodeTable *dt, BitReader *br) {
+    int root_bits = dt->root_bits;
+    br_refill(br);
+    DecodeEntry e = dt->entries[br_peek_bits(br, root_bits)];
+    if (e.kind == DE_SYMBOL && e.len <= br->bits) {
+        /* fast path: the whole code is in the root table */
+        br_skip_bits(br, e.len);
+        return (int)e.value;
+    }
+    int peeked = root_bits;
+    if (e.kind == DE_LINK) {
+        if (br->bits < root_bits) return HUF_ERR_TRUNCATED;
+        br_skip_bits(br, root_bits);
+        peeked = e.len;
+        e = dt->entries[e.value + br_peek_bits(br, e.len)];
+        if (e.kind == DE_SYMBOL) {
+            if (br->bits < e.len - root_bits) return HUF_ERR_TRUNCATED;
+            br_skip_bits(br, e.len - root_bits);
+            return (int)e.value;
+        }
+    } else if (e.kind == DE_SYMBOL) {
+        return HUF_ERR_TRUNCATED;
+    }
+    /* Unassigned bit pattern: fine if it only exists because of EOF padding */
+    if (br->bits < peeked) return HUF_ERR_TRUNCATED;
+    return HUF_ERR_CORRUPT;
+}
+
+/* Decode one to MULTI_MAX_SYMS symbols into dst, which must have room for
+   MULTI_MAX_SYMS bytes. Returns the number written or a HUF_ERR code. */
+static inline int decode_multi(const DecodeTable *dt, BitReader *br, uint8_t *dst) {
+    br_refill(br);
+    uint32_t m = dt->multi[br_peek_bits(br, dt->root_bits)];
+    int bits = (int)((m >> 24) & 0x1F);
+    int count = (int)(m >> 29);
+    if (count > 0 && bits <= br->bits) {
+        dst[0] = (uint8_t)m;
+        dst[1] = (uint8_t)(m >> 8);
+        dst[2] = (uint8_t)(m >> 16);
+        br_skip_bits(br, bits);
+        return count;
+    }
+    int sym = decode_symbol(dt, br);
+    if (sym < 0) return sym;
+    dst[0] = (uint8_t)sym;
+    return 1;
+}
+
+int huf_decode_run(const DecodeTable *dt, BitReader *br, uint8_t *dst, size_t n) {
+    size_t i = 0;
+    if (dt->multi) {
+        while (i + MULTI_MAX_SYMS <= n) {
+            int got = decode_multi(dt, br, dst + i);
+            if (got < 0) return got;
+            i += (size_t)got;
+        }
+    }
+    for (; i < n; ++i) {
+        int sym = decode_symbol(dt, br);
+        if (sym < 0) return sym;
+        dst[i] = (uint8_t)sym;
+    }
+    return HUF_OK;
+}
+
+/* -------------------- Statistics -------------------- */
+
+void huf_stats_add_codes(HufStats *st, const uint32_t freq[256], const Code table[256]) {
+    for (int i = 0; i < 256; ++i) {
+        st->freq[i] += freq[i];
+        st->coded_symbols += freq[i];
+        st->coded_bits += (uint64_t)freq[i] * table[i].len;
+        if (freq[i] && table[i].len > st->max_code_len) st->max_code_len = table[i].len;
+    }
+}
+
+void huf_stats_merge(HufStats *dst, const HufStats *src) {
+    for (int i = 0; i < PH_COUNT; ++i) dst->ns[i] += src->ns[i];
+    for (int i = 0; i < 256; ++i) dst->freq[i] += src->freq[i];
+    for (int i = 0; i < BT_COUNT; ++i) dst->blocks[i] += src->blocks[i];
+    dst->coded_bits += src->coded_bits;
+    dst->coded_symbols += src->coded_symbols;
+    if (src->max_code_len > dst->max_code_len) dst->max_code_len = src->max_code_len;
+}
+
+/* Byte counts of a block that is not Huffman coded */
+static void stats_add_plain(HufStats *st, const uint8_t *src, size_t n, int type) {
+    uint32_t freq[256] = {0};
+    huf_histogram(src, n, freq);
+    for (int i = 0; i < 256; ++i) st->freq[i] += freq[i];
+    st->blocks[type]++;
+}
+
+/* -------------------- Block Coding -------------------- */
+
+/* Bit-pack src[0..n) into dst; returns the bytes written */
+static size_t encode_stream(const Code table[256], const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    BitWriter bw;
+    bw_init_mem(&bw, dst, cap);
+    for (size_t i = 0; i < n; ++i) {
+        bw_write_bits(&bw, table[src[i]].code, table[src[i]].len);
+    }
+    bw_flush(&bw);
+    return bw.pos;
+}
+
+/* Bit-pack src[0..n), each byte with the table of the byte before it */
+static size_t encode_stream_order1(const Code *const ctx[256], const uint8_t *src, size_t n,
+                                   uint8_t *dst, size_t cap) {
+    BitWriter bw;
+    bw_init_mem(&bw, dst, cap);
+    const Code *table = ctx[0];
+    for (size_t i = 0; i < n; ++i) {
+        bw_write_bits(&bw, table[src[i]].code, table[src[i]].len);
+        table = ctx[src[i]];
+    }
+    bw_flush(&bw);
+    return bw.pos;
+}
+
+/* Byte range of stream k when a block of n bytes is split four ways */
+static void stream_segment(size_t n, int k, size_t *start, size_t *len) {
+    size_t q = (n + 3) / 4;
+    size_t s = q * (size_t)k;
+    *start = s < n ? s : n;
+    *len = s < n ? (n - s < q ? n - s : q) : 0;
+}
+
+/* Write the bitstreams of src[0..n) to dst, after the jump table when
+   streams4 is set: coded with table, or with ctx[previous byte] if ctx is
+   not NULL. Returns the bytes written. */
+static size_t encode_streams(const Code table[256], const Code *const ctx[256], const uint8_t *src,
+                             size_t n, int streams4, uint8_t *dst, size_t cap) {
+    if (!streams4) {
+        return ctx ? encode_stream_order1(ctx, src, n, dst, cap) : encode_stream(table, src, n, dst, cap);
+    }
+    size_t pos = 12;
+    for (int k = 0; k < 4; ++k) {
+        size_t start, len, size;
+        stream_segment(n, k, &start, &len);
+        if (ctx) size = encode_stream_order1(ctx, src + start, len, dst + pos, cap - pos);
+        else size = encode_stream(table, src + start, len, dst + pos, cap - pos);
+        if (k < 3) store_le32(dst + 4 * k, (uint32_t)size);
+        pos += size;
+    }
+    return pos;
+}
+
+/* -------------------- Order-1 Contexts -------------------- */
+
+/* An order-1 block codes every byte with one of a few tables, chosen by
+   the byte before it (0 at the start of each stream). The 256 contexts are
+   clustered onto the tables Lloyd-style: each context moves to the table
+   that codes its successors in the fewest bits, the tables are rebuilt
+   from their members, and so on for a few rounds. Tables are added one at
+   a time, each seeded by the context that costs the most bits so far,
+   while the block keeps getting smaller. */
+#define ORDER1_ROUNDS 4
+
+typedef struct {
+    uint32_t pairs[256][256];               /* pairs[previous][byte] */
+    uint8_t next[256][256];                 /* bytes seen after each context */
+    int nnext[256];
+    uint32_t freq[ORDER1_MAX_TABLES][256];  /* byte counts per table */
+    uint8_t lens[ORDER1_MAX_TABLES][256];   /* code lengths while clustering */
+    Code table[ORDER1_MAX_TABLES][256];     /* final tables */
+    uint8_t map[256];                       /* context -> table */
+    int tables;
+} Order1Model;
+
+/* Bits per context map entry */
+static int order1_map_bits(int tables) {
+    int bits = 0;
+    while ((1 << bits) < tables) bits++;
+    return bits;
+}
+
+/* Add the bytes of src[0..n) to freq[map[previous byte]], with the streams
+   of a four-stream block each starting from context 0 */
+static void order1_count(const uint8_t *src, size_t n, int streams4, const uint8_t map[256],
+                         uint32_t (*freq)[256]) {
+    for (int k = 0; k < (streams4 ? 4 : 1); ++k) {
+        size_t start = 0, len = n;
+        if (streams4) stream_segment(n, k, &start, &len);
+        uint8_t prev = 0;
+        for (size_t i = start; i < start + len; ++i) {
+            freq[map[prev]][src[i]]++;
+            prev = src[i];
+        }
+    }
+}
+
+/* Bits to code context c with lens */
+static uint64_t order1_cost(const Order1Model *m, int c, const uint8_t lens[256]) {
+    uint64_t bits = 0;
+    for (int k = 0; k < m->nnext[c]; ++k) {
+        int i = m->next[c][k];
+        bits += (uint64_t)m->pairs[c][i] * lens[i];
+    }
+    return bits;
+}
+
+/* Lengths for a table while clustering: every byte of the block gets a
+   code, so any context can be costed against any table */
+static void order1_lens(const uint32_t freq[256], const uint32_t block[256], int max_len, uint8_t lens[256]) {
+    uint32_t f[256];
+    Code t[256];
+    for (int i = 0; i < 256; ++i) f[i] = freq[i] + (block[i] != 0);
+    huf_build_code_table(f, t, max_len);
+    for (int i = 0; i < 256; ++i) lens[i] = t[i].len;
+}
+
+/* Renumber the tables in use by the active contexts and recount them;
+   unused contexts go to table 0 */
+static void order1_regroup(Order1Model *m, const int *active, int nactive) {
+    int renum[ORDER1_MAX_TABLES];
+    for (int j = 0; j < ORDER1_MAX_TABLES; ++j) renum[j] = -1;
+    uint8_t map[256] = {0};
+    int tables = 0;
+    for (int a = 0; a < nactive; ++a) {
+        int j = m->map[active[a]];
+        if (renum[j] < 0) renum[j] = tables++;
+        map[active[a]] = (uint8_t)renum[j];
+    }
+    memcpy(m->map, map, sizeof(map));
+    m->tables = tables;
+    memset(m->freq, 0, sizeof(m->freq));
+    for (int a = 0; a < nactive; ++a) {
+        int c = active[a];
+        for (int k = 0; k < m->nnext[c]; ++k) {
+            int i = m->next[c][k];
+            m->freq[map[c]][i] += m->pairs[c][i];
+        }
+    }
+}
+
+/* Build the final tables for m->map; returns the payload size they give,
+   checksum excluded */
+static size_t order1_finish(Order1Model *m, int max_len, int streams4) {
+    size_t size = 1 + 32 * (size_t)order1_map_bits(m->tables) + (streams4 ? 12 + 3 : 0);
+    uint64_t bits = 0;
+    uint8_t lens[256], cl[CODE_LENGTHS_MAX_BYTES];
+    for (int j = 0; j < m->tables; ++j) {
+        huf_build_code_table(m->freq[j], m->table[j], max_len);
+        for (int i = 0; i < 256; ++i) {
+            lens[i] = m->table[j][i].len;
+            bits += (uint64_t)m->freq[j][i] * lens[i];
+        }
+        size += huf_pack_code_lengths(lens, cl);
+    }
+    return size + (size_t)((bits + 7) / 8);
+}
+
+/* Cluster the contexts of src[0..n) into m; returns the predicted payload
+   size of the best clustering (checksum excluded), or SIZE_MAX if the
+   block has too few contexts to split */
+static size_t order1_model(const uint8_t *src, size_t n, int streams4, const uint32_t block[256],
+                           int max_len, Order1Model *m) {
+    uint8_t identity[256];
+    for (int c = 0; c < 256; ++c) identity[c] = (uint8_t)c;
+    memset(m->pairs, 0, sizeof(m->pairs));
+    order1_count(src, n, streams4, identity, m->pairs);
+
+    int active[256], nactive = 0;
+    for (int c = 0; c < 256; ++c) {
+        m->nnext[c] = 0;
+        for (int i = 0; i < 256; ++i) {
+            if (m->pairs[c][i]) m->next[c][m->nnext[c]++] = (uint8_t)i;
+        }
+        if (m->nnext[c]) active[nactive++] = c;
+    }
+    memset(m->map, 0, sizeof(m->map));
+    order1_regroup(m, active, nactive);
+
+    uint8_t best_map[256];
+    size_t best = SIZE_MAX;
+    int stale = 0;
+    for (int step = 1; step < ORDER1_MAX_TABLES && stale < 2; ++step) {
+        if (m->tables >= ORDER1_MAX_TABLES || m->tables >= nactive) break;
+        int members[ORDER1_MAX_TABLES] = {0};
+        for (int j = 0; j < m->tables; ++j) order1_lens(m->freq[j], block, max_len, m->lens[j]);
+        for (int a = 0; a < nactive; ++a) members[m->map[active[a]]]++;
+
+        uint64_t worst = 0;
+        int seed = -1;
+        for (int a = 0; a < nactive; ++a) {
+            int c = active[a];
+            if (members[m->map[c]] < 2) continue;
+            uint64_t cost = order1_cost(m, c, m->lens[m->map[c]]);
+            if (cost > worst) {
+                worst = cost;
+                seed = c;
+            }
+        }
+        if (seed < 0) break;
+        int fresh = m->tables++;
+        m->map[seed] = (uint8_t)fresh;
+        order1_lens(m->pairs[seed], block, max_len, m->lens[fresh]);
+
+        for (int r = 0; r < ORDER1_ROUNDS; ++r) {
+            int moved = 0;
+            for (int a = 0; a < nactive; ++a) {
+                int c = active[a], pick = m->map[c];
+                uint64_t low = order1_cost(m, c, m->lens[pick]);
+                for (int j = 0; j < m->tables; ++j) {
+                    uint64_t cost = order1_cost(m, c, m->lens[j]);
+                    if (cost < low) {
+                        low = cost;
+                        pick = j;
+                    }
+                }
+                if (pick != m->map[c]) {
+                    m->map[c] = (uint8_t)pick;
+                    moved = 1;
+                }
+            }
+            order1_regroup(m, active, nactive);
+            if (!moved) break;
+            for (int j = 0; j < m->tables; ++j) order1_lens(m->freq[j], block, max_len, m->lens[j]);
+        }
+
+        size_t size = order1_finish(m, max_len, streams4);
+        if (size < best) {
+            best = size;
+            memcpy(best_map, m->map, sizeof(best_map));
+            stale = 0;
+        } else {
+            stale++;
+        }
+    }
+    if (best == SIZE_MAX) return SIZE_MAX;
+    memcpy(m->map, best_map, sizeof(best_map));
+    order1_regroup(m, active, nactive);
+    return order1_finish(m, max_len, streams4);
+}
+
+/* Table count, context map and code lengths of an order-1 block; returns
+   the bytes written */
+static size_t order1_pack_header(const Order1Model *m, uint8_t *dst) {
+    int bits = order1_map_bits(m->tables);
+    dst[0] = (uint8_t)(m->tables - 1);
+    BitWriter bw;
+    bw_init_mem(&bw, dst + 1, 32 * (size_t)bits);
+    for (int c = 0; bits && c < 256; ++c) bw_write_bits(&bw, m->map[c], bits);
+    bw_flush(&bw);
+    size_t pos = 1 + bw.pos;
+    uint8_t lens[256];
+    for (int j = 0; j < m->tables; ++j) {
+        for (int i = 0; i < 256; ++i) lens[i] = m->table[j][i].len;
+        pos += huf_pack_code_lengths(lens, dst + pos);
+    }
+    return pos;
+}
+
+/* Store h for a payload that ends at dst + pos, after appending the
+   block's checksum if params ask for one. Returns the block's size. */
+static size_t finish_block(BlockHeader *h, const uint8_t *src, uint8_t *dst, size_t pos,
+                           const HuffParams *params) {
+    if (params->checksum) {
+        h->flags |= BF_CRC32C;
+        store_le32(dst + pos, huf_crc32c(src, h->original_size));
+        pos += BLOCK_CHECKSUM_SIZE;
+    }
+    h->payload_size = (uint32_t)(pos - BLOCK_HEADER_SIZE);
+    store_block_header(dst, h);
+    return pos;
+}
+
+/* Code src[0..n) into out as the payload of a Huffman, order-1, stored or
+   run block, and set h's type and stream flag. The payload never exceeds
+   n bytes. */
+static size_t encode_entropy(const uint8_t *src, size_t n, uint8_t *out, const HuffParams *params,
+                             HufStats *st, BlockHeader *h) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    uint32_t freq[256] = {0};
+    huf_histogram(src, n, freq);
+    huf_stats_lap(st, PH_HISTOGRAM, &t);
+
+    int distinct = 0, last = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i]) {
+            ++distinct;
+            last = i;
+        }
+    }
+    if (distinct == 1) {
+        h->type = BT_RLE;
+        out[0] = (uint8_t)last;
+        if (st) {
+            st->freq[last] += n;
+            st->blocks[BT_RLE]++;
+        }
+        return 1;
+    }
+
+    Code table[256];
+    huf_build_code_table(freq, table, params->max_code_len);
+
+    /* The histogram gives the exact coded size up front: store the block
+       as it is unless the table, jump table and padding still leave a gain */
+    uint8_t lens[256], cl[CODE_LENGTHS_MAX_BYTES];
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        lens[i] = table[i].len;
+        bits += (uint64_t)freq[i] * table[i].len;
+    }
+    size_t cl_size = huf_pack_code_lengths(lens, cl);
+    int streams4 = params->streams == 4 && n >= MIN_STREAMS4_SIZE;
+    size_t predicted = cl_size + (streams4 ? 12 + 3 : 0) + (size_t)((bits + 7) / 8);
+
+    /* Order-1 tables only for blocks they make smaller; without memory for
+       the pair counts the block is simply coded order-0 */
+    Order1Model *m = NULL;
+    if (params->order1 && n >= ORDER1_MIN_SIZE && (m = (Order1Model*)malloc(sizeof(*m))) != NULL) {
+        size_t size = order1_model(src, n, streams4, freq, params->max_code_len, m);
+        if (size < predicted) {
+            predicted = size;
+        } else {
+            free(m);
+            m = NULL;
+        }
+    }
+    huf_stats_lap(st, PH_TREE, &t);
+
+    if (predicted >= n) {
+        free(m);
+        h->type = BT_RAW;
+        memcpy(out, src, n);
+        if (st) {
+            huf_stats_lap(st, PH_CODE, &t);
+            for (int i = 0; i < 256; ++i) st->freq[i] += freq[i];
+            st->blocks[BT_RAW]++;
+        }
+        return n;
+    }
+
+    size_t pos = 0;
+    const Code *ctx[256];
+    if (m) {
+        h->type = BT_ORDER1;
+        pos += order1_pack_header(m, out);
+        for (int c = 0; c < 256; ++c) ctx[c] = m->table[m->map[c]];
+    } else {
+        h->type = BT_HUFFMAN;
+        memcpy(out, cl, cl_size);
+        pos += cl_size;
+    }
+    if (streams4) h->flags |= BF_STREAMS4;
+    pos += encode_streams(table, m ? ctx : NULL, src, n, streams4, out + pos, n - pos);
+
+    if (st) {
+        huf_stats_lap(st, PH_CODE, &t);
+        if (m) {
+            for (int j = 0; j < m->tables; ++j) huf_stats_add_codes(st, m->freq[j], m->table[j]);
+        } else {
+            huf_stats_add_codes(st, freq, table);
+        }
+        st->blocks[h->type]++;
+    }
+    free(m);
+    return pos;
+}
+
+/* -------------------- Transforms -------------------- */
+
+/* Passes that reshape a block before entropy coding; the encoder keeps one
+   only when the block comes out smaller, and the block header says which
+   was used. RLE4 (flag BF_RLE4, any block type) is the run-length pass of
+   bzip2. LZ77 (block type BT_LZ77) turns repeats into sequences: ll
+   literals, then a copy of ml bytes from off bytes back. Literals and the
+   three code streams are coded as nested Huffman/order-1/stored/run
+   blocks; the low bits of large values follow as a raw bitstream. */
+
+/* RLE4: after four equal bytes comes a count of 0..255 further repeats */
+#define RLE4_RUN 4
+
+static size_t rle4_bound(size_t n) {
+    return n + n / RLE4_RUN + 1;
+}
+
+static size_t rle4_encode(const uint8_t *src, size_t n, uint8_t *dst) {
+    size_t i = 0, o = 0;
+    while (i < n) {
+        uint8_t b = src[i];
+        size_t run = 1;
+        while (i + run < n && src[i + run] == b && run < RLE4_RUN + 255) run++;
+        if (run >= RLE4_RUN) {
+            memset(dst + o, b, RLE4_RUN);
+            o += RLE4_RUN;
+            dst[o++] = (uint8_t)(run - RLE4_RUN);
+        } else {
+            memset(dst + o, b, run);
+            o += run;
+        }
+        i += run;
+    }
+    return o;
+}
+
+/* Expand m bytes of RLE4 into exactly n bytes at dst */
+static int rle4_decode(const uint8_t *src, size_t m, uint8_t *dst, size_t n) {
+    size_t i = 0, o = 0;
+    int prev = -1, run = 0;
+    while (i < m) {
+        uint8_t b = src[i++];
+        if (o == n) return HUF_ERR_CORRUPT;
+        dst[o++] = b;
+        run = b == prev ? run + 1 : 1;
+        prev = b;
+        if (run == RLE4_RUN) {
+            if (i == m) return HUF_ERR_TRUNCATED;
+            size_t count = src[i++];
+            if (count > n - o) return HUF_ERR_CORRUPT;
+            memset(dst + o, b, count);
+            o += count;
+            prev = -1;
+        }
+    }
+    return o == n ? HUF_OK : HUF_ERR_CORRUPT;
+}
+
+/* LZ77: greedy parse over a hash chain of 4-byte prefixes */
+#define LZ_MIN_MATCH   4
+#define LZ_WINDOW_BITS 18
+#define LZ_WINDOW      (1u << LZ_WINDOW_BITS)  /* offsets stay below this */
+#define LZ_HASH_BITS   16
+#define LZ_MAX_CHAIN   16                      /* candidates tried per position */
+
+/* Nested blocks of an LZ77 payload */
+enum { LZ_LITERALS, LZ_LL, LZ_ML, LZ_OF, LZ_STREAMS };
+
+typedef struct {
+    int32_t head[1u << LZ_HASH_BITS];  /* latest position per hash, or -1 */
+    int32_t chain[LZ_WINDOW];          /* previous position with the same hash */
+    uint8_t *lits;                     /* literals, back to back */
+    uint8_t *codes[LZ_STREAMS];        /* per sequence: ll, ml, off codes */
+    size_t nlits, nseq;
+    BitWriter extra;                   /* low bits of large values */
+} LzParse;
+
+static int bit_length(uint32_t v) {
+    int bits = 0;
+    while (v) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+/* Lengths below 16 are their own code; larger ones code their bit length,
+   and the bits below the leading one follow as extra bits */
+static void lz_put_length(LzParse *p, uint8_t *code, uint32_t v) {
+    if (v < 16) {
+        *code = (uint8_t)v;
+        return;
+    }
+    int e = bit_length(v) - 1;
+    *code = (uint8_t)(12 + e);
+    bw_write_bits(&p->extra, v & ((1u << e) - 1u), e);
+}
+
+/* Offsets code their bit length, with the bits below the leading one */
+static void lz_put_offset(LzParse *p, uint8_t *code, uint32_t off) {
+    int e = bit_length(off) - 1;
+    *code = (uint8_t)e;
+    if (e) bw_write_bits(&p->extra, off & ((1u << e) - 1u), e);
+}
+
+static uint32_t lz_hash(const uint8_t *p) {
+    return (load_le32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_insert(LzParse *p, const uint8_t *src, size_t i) {
+    uint32_t hash = lz_hash(src + i);
+    p->chain[i & (LZ_WINDOW - 1)] = p->head[hash];
+    p->head[hash] = (int32_t)i;
+}
+
+static size_t lz_match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t len = 0;
+    while (len + 8 <= max && load_le64(a + len) == load_le64(b + len)) len += 8;
+    while (len < max && a[len] == b[len]) len++;
+    return len;
+}
+
+/* Parse src[0..n) into p, whose buffers hold n literals and
+   n / LZ_MIN_MATCH codes each */
+static void lz_parse(const uint8_t *src, size_t n, LzParse *p) {
+    for (size_t i = 0; i < (1u << LZ_HASH_BITS); ++i) p->head[i] = -1;
+    p->nlits = p->nseq = 0;
+    size_t i = 0, anchor = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        int32_t cand = p->head[lz_hash(src + i)];
+        lz_insert(p, src, i);
+        size_t best_len = 0, best_off = 0;
+        for (int depth = 0; cand >= 0 && depth < LZ_MAX_CHAIN; ++depth) {
+            size_t off = i - (size_t)cand;
+            if (off >= LZ_WINDOW) break;
+            if (src[cand + best_len] == src[i + best_len]) {
+                size_t len = lz_match_length(src + cand, src + i, n - i);
+                if (len > best_len) {
+                    best_len = len;
+                    best_off = off;
+                    if (len == n - i) break;
+                }
+            }
+            cand = p->chain[cand & (LZ_WINDOW - 1)];
+        }
+        if (best_len < LZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+        size_t ll = i - anchor, s = p->nseq++;
+        memcpy(p->lits + p->nlits, src + anchor, ll);
+        p->nlits += ll;
+        lz_put_length(p, &p->codes[LZ_LL][s], (uint32_t)ll);
+        lz_put_length(p, &p->codes[LZ_ML][s], (uint32_t)(best_len - LZ_MIN_MATCH));
+        lz_put_offset(p, &p->codes[LZ_OF][s], (uint32_t)best_off);
+        size_t end = i + best_len;
+        for (size_t k = i + 1; k < end && k + LZ_MIN_MATCH <= n; ++k) lz_insert(p, src, k);
+        i = anchor = end;
+    }
+    memcpy(p->lits + p->nlits, src + anchor, n - anchor);
+    p->nlits += n - anchor;
+    bw_flush(&p->extra);
+}
+
+/* A block inside a transformed payload: header and entropy-coded payload,
+   never a checksum. Returns its size. */
+static size_t encode_nested(const uint8_t *src, size_t n, uint8_t *dst, const HuffParams *params) {
+    BlockHeader h = { BT_RAW, 0, (uint32_t)n, 0 };
+    h.payload_size = (uint32_t)encode_entropy(src, n, dst + BLOCK_HEADER_SIZE, params, NULL, &h);
+    store_block_header(dst, &h);
+    return BLOCK_HEADER_SIZE + h.payload_size;
+}
+
+/* LZ77 payload of src[0..n) into a new buffer; NULL without memory or
+   when nothing repeats. *size is its length. */
+static uint8_t *encode_lz77(const uint8_t *src, size_t n, const HuffParams *params, size_t *size) {
+    size_t max_seq = n / LZ_MIN_MATCH;
+    /* per sequence at most 31 + 31 + LZ_WINDOW_BITS extra bits */
+    size_t extra_cap = max_seq * 10 + 16;
+    LzParse *p = (LzParse*)malloc(sizeof(*p));
+    uint8_t *work = (uint8_t*)malloc(n + 3 * max_seq + extra_cap);
+    if (!p || !work) {
+        free(p);
+        free(work);
+        return NULL;
+    }
+    p->lits = work;
+    for (int k = LZ_LL; k < LZ_STREAMS; ++k) p->codes[k] = work + n + (size_t)(k - 1) * max_seq;
+    bw_init_mem(&p->extra, work + n + 3 * max_seq, extra_cap);
+    lz_parse(src, n, p);
+
+    uint8_t *out = NULL;
+    if (p->nseq > 0) {
+        out = (uint8_t*)malloc(4 + LZ_STREAMS * BLOCK_HEADER_SIZE + p->nlits + 3 * p->nseq + p->extra.pos);
+    }
+    if (out) {
+        HuffParams nested = *params;
+        nested.transforms = 0;
+        store_le32(out, (uint32_t)p->nseq);
+        size_t pos = 4;
+        pos += encode_nested(p->lits, p->nlits, out + pos, &nested);
+        for (int k = LZ_LL; k < LZ_STREAMS; ++k) pos += encode_nested(p->codes[k], p->nseq, out + pos, &nested);
+        memcpy(out + pos, p->extra.buf, p->extra.pos);
+        *size = pos + p->extra.pos;
+    }
+    free(work);
+    free(p);
+    return out;
+}
+
+/* Try the transforms params allow on src[0..n). If one codes smaller than
+   the *size payload bytes at out, it replaces them, *size and h are
+   updated and 1 is returned. */
+static int encode_transformed(const uint8_t *src, size_t n, uint8_t *out, size_t *size,
+                              const HuffParams *params, HufStats *st, BlockHeader *h) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    HuffParams inner = *params;
+    inner.transforms = 0;
+    uint8_t *best = NULL;
+    size_t best_size = *size;
+    BlockHeader best_h = *h;
+
+    if (params->transforms & HUFF_TRANSFORM_RLE) {
+        uint8_t *runs = (uint8_t*)malloc(rle4_bound(n));
+        uint8_t *cand = runs ? (uint8_t*)malloc(4 + n) : NULL;
+        size_t m = cand ? rle4_encode(src, n, runs) : n;
+        if (m < n) {
+            BlockHeader rh = { BT_RAW, BF_RLE4, (uint32_t)n, 0 };
+            store_le32(cand, (uint32_t)m);
+            size_t csize = 4 + encode_entropy(runs, m, cand + 4, &inner, NULL, &rh);
+            if (csize < best_size) {
+                best = cand;
+                best_size = csize;
+                best_h = rh;
+                cand = NULL;
+            }
+        }
+        free(cand);
+        free(runs);
+    }
+    if (params->transforms & HUFF_TRANSFORM_LZ77) {
+        size_t csize;
+        uint8_t *cand = encode_lz77(src, n, &inner, &csize);
+        if (cand && csize < best_size) {
+            free(best);
+            best = cand;
+            best_size = csize;
+            best_h.type = BT_LZ77;
+            best_h.flags = 0;
+            cand = NULL;
+        }
+        free(cand);
+    }
+    huf_stats_lap(st, PH_TRANSFORM, &t);
+    if (!best) return 0;
+
+    memcpy(out, best, best_size);
+    free(best);
+    *size = best_size;
+    *h = best_h;
+    if (st) stats_add_plain(st, src, n, h->type);
+    return 1;
+}
+
+size_t huf_encode_block(const uint8_t *src, size_t n, uint8_t *dst, const HuffParams *params,
+                        HufStats *st) {
+    BlockHeader h = { BT_RAW, 0, (uint32_t)n, 0 };
+    if (!params->transforms) {
+        size_t size = encode_entropy(src, n, dst + BLOCK_HEADER_SIZE, params, st, &h);
+        return finish_block(&h, src, dst, BLOCK_HEADER_SIZE + size, params);
+    }
+    /* The plain coding is only counted if no transform beats it */
+    HufStats plain;
+    if (st) memset(&plain, 0, sizeof(plain));
+    size_t size = encode_entropy(src, n, dst + BLOCK_HEADER_SIZE, params, st ? &plain : NULL, &h);
+    if (encode_transformed(src, n, dst + BLOCK_HEADER_SIZE, &size, params, st, &h)) {
+        if (st) {
+            for (int i = 0; i < PH_COUNT; ++i) st->ns[i] += plain.ns[i];
+        }
+    } else if (st) {
+        huf_stats_merge(st, &plain);
+    }
+    return finish_block(&h, src, dst, BLOCK_HEADER_SIZE + size, params);
+}
+
+/* -------------------- Adaptive Splitting -------------------- */
+
+/* A block is planned in chunks: consecutive chunks form a segment, and
+   every segment becomes a block with its own table */
+typedef struct {
+    uint32_t freq[SPLIT_MAX_BLOCKS][256];
+    size_t start[SPLIT_MAX_BLOCKS], len[SPLIT_MAX_BLOCKS];
+    uint64_t cost[SPLIT_MAX_BLOCKS];
+    int64_t gain[SPLIT_MAX_BLOCKS];  /* bytes saved by merging segment i with i + 1 */
+    size_t count;
+} SplitPlan;
+
+/* Estimated size of an n-byte order-0 block with histogram freq: header,
+   code lengths, jump table and coded bits, or the stored size if smaller */
+static uint64_t split_cost(const uint32_t freq[256], size_t n, const HuffParams *params) {
+    int distinct = 0;
+    for (int i = 0; i < 256; ++i) distinct += freq[i] != 0;
+    if (distinct <= 1) return BLOCK_HEADER_SIZE + 1;
+
+    Code table[256];
+    huf_build_code_table(freq, table, params->max_code_len);
+    uint8_t lens[256], cl[CODE_LENGTHS_MAX_BYTES];
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        lens[i] = table[i].len;
+        bits += (uint64_t)freq[i] * table[i].len;
+    }
+    int streams4 = params->streams == 4 && n >= MIN_STREAMS4_SIZE;
+    uint64_t size = huf_pack_code_lengths(lens, cl) + (streams4 ? 12 + 3 : 0) + (bits + 7) / 8;
+    return BLOCK_HEADER_SIZE + (size < n ? size : n);
+}
+
+static int64_t split_gain(const SplitPlan *s, size_t i, const HuffParams *params) {
+    uint32_t f[256];
+    for (int k = 0; k < 256; ++k) f[k] = s->freq[i][k] + s->freq[i + 1][k];
+    uint64_t merged = split_cost(f, s->len[i] + s->len[i + 1], params);
+    return (int64_t)(s->cost[i] + s->cost[i + 1]) - (int64_t)merged;
+}
+
+/* Cut src[0..n) into segments. A chunk joins the running segment unless
+   coding it with a table of its own saves more than the extra header and
+   table; then neighbours are merged, best gain first, while one table
+   for both still beats two, which undoes cuts that only noise made. */
+static void split_plan(const uint8_t *src, size_t n, const HuffParams *params, HufStats *st,
+                       SplitPlan *s) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    size_t chunk = split_chunk_size(n);
+    s->count = 0;
+    for (size_t off = 0; off < n; off += chunk) {
+        size_t len = n - off < chunk ? n - off : chunk;
+        uint32_t *cur = s->freq[s->count];
+        memset(cur, 0, sizeof(s->freq[0]));
+        huf_histogram(src + off, len, cur);
+        huf_stats_lap(st, PH_HISTOGRAM, &t);
+
+        uint64_t cost = split_cost(cur, len, params);
+        if (s->count > 0) {
+            size_t j = s->count - 1;
+            uint32_t f[256];
+            for (int k = 0; k < 256; ++k) f[k] = s->freq[j][k] + cur[k];
+            uint64_t merged = split_cost(f, s->len[j] + len, params);
+            if (merged <= s->cost[j] + cost) {
+                memcpy(s->freq[j], f, sizeof(f));
+                s->len[j] += len;
+                s->cost[j] = merged;
+                huf_stats_lap(st, PH_TREE, &t);
+                continue;
+            }
+        }
+        s->start[s->count] = off;
+        s->len[s->count] = len;
+        s->cost[s->count] = cost;
+        s->count++;
+        huf_stats_lap(st, PH_TREE, &t);
+    }
+
+    for (size_t i = 0; i + 1 < s->count; ++i) s->gain[i] = split_gain(s, i, params);
+    while (s->count > 1) {
+        size_t best = 0;
+        for (size_t i = 1; i + 1 < s->count; ++i) {
+            if (s->gain[i] > s->gain[best]) best = i;
+        }
+        if (s->gain[best] < 0) break;
+        for (int k = 0; k < 256; ++k) s->freq[best][k] += s->freq[best + 1][k];
+        s->len[best] += s->len[best + 1];
+        s->cost[best] = s->cost[best] + s->cost[best + 1] - (uint64_t)s->gain[best];
+        size_t rest = s->count - best - 2;
+        memmove(s->freq[best + 1], s->freq[best + 2], rest * sizeof(s->freq[0]));
+        memmove(&s->start[best + 1], &s->start[best + 2], rest * sizeof(s->start[0]));
+        memmove(&s->len[best + 1], &s->len[best + 2], rest * sizeof(s->len[0]));
+        memmove(&s->cost[best + 1], &s->cost[best + 2], rest * sizeof(s->cost[0]));
+        memmove(&s->gain[best + 1], &s->gain[best + 2], rest * sizeof(s->gain[0]));
+        s->count--;
+        if (best > 0) s->gain[best - 1] = split_gain(s, best - 1, params);
+        if (best + 1 < s->count) s->gain[best] = split_gain(s, best, params);
+    }
+    huf_stats_lap(st, PH_TREE, &t);
+}
+
+size_t huf_encode_blocks(const uint8_t *src, size_t n, uint8_t *dst, const HuffParams *params,
+                         HufStats *st, BlockSplit *split) {
+    /* Without room for the plan the input is simply one block */
+    SplitPlan *s = NULL;
+    if (split_max_blocks(n, params->adaptive) > 1) s = (SplitPlan*)malloc(sizeof(*s));
+    if (!s) {
+        size_t size = huf_encode_block(src, n, dst, params, st);
+        split->count = 1;
+        split->original_size[0] = (uint32_t)n;
+        split->stored_size[0] = (uint32_t)size;
+        return size;
+    }
+    split_plan(src, n, params, st, s);
+    size_t pos = 0;
+    for (size_t i = 0; i < s->count; ++i) {
+        size_t size = huf_encode_block(src + s->start[i], s->len[i], dst + pos, params, st);
+        split->original_size[i] = (uint32_t)s->len[i];
+        split->stored_size[i] = (uint32_t)size;
+        pos += size;
+    }
+    split->count = s->count;
+    free(s);
+    return pos;
+}
+
+/* Decode n symbols from one bitstream */
+static int decode_stream(const DecodeTable *dt, const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    BitReader br;
+    br_init_mem(&br, src, len);
+    return huf_decode_run(dt, &br, dst, n);
+}
+
+/* Split a four-stream payload of len bytes: stream k is read by br[k]
+   and decodes count[k] bytes to out[k] */
+static int streams4_open(const uint8_t *src, size_t len, uint8_t *dst, size_t n,
+                         BitReader br[4], uint8_t *out[4], size_t count[4]) {
+    if (len < 12) return HUF_ERR_TRUNCATED;
+    size_t sizes[4], total = 12;
+    for (int k = 0; k < 3; ++k) {
+        sizes[k] = load_le32(src + 4 * k);
+        total += sizes[k];
+    }
+    if (total > len) return HUF_ERR_TRUNCATED;
+    sizes[3] = len - total;
+
+    const uint8_t *p = src + 12;
+    for (int k = 0; k < 4; ++k) {
+        size_t start;
+        stream_segment(n, k, &start, &count[k]);
+        out[k] = dst + start;
+        br_init_mem(&br[k], p, sizes[k]);
+        p += sizes[k];
+    }
+    return HUF_OK;
+}
+
+/* Four streams advance in the same loop: their symbol chains are
+   independent, so an out-of-order core overlaps the table lookups. */
+static int decode_streams4(const DecodeTable *dt, const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    BitReader br[4];
+    uint8_t *out[4];
+    size_t count[4];
+    int err = streams4_open(src, len, dst, n, br, out, count);
+    if (err != HUF_OK) return err;
+
+    if (dt->multi) {
+        /* Each stream advances by its own count; stop when any gets close
+           to its end and let huf_decode_run finish them one by one. */
+        size_t pos[4] = {0, 0, 0, 0};
+        while (pos[0] + MULTI_MAX_SYMS <= count[0] && pos[1] + MULTI_MAX_SYMS <= count[1] &&
+               pos[2] + MULTI_MAX_SYMS <= count[2] && pos[3] + MULTI_MAX_SYMS <= count[3]) {
+            int g0 = decode_multi(dt, &br[0], out[0] + pos[0]);
+            int g1 = decode_multi(dt, &br[1], out[1] + pos[1]);
+            int g2 = decode_multi(dt, &br[2], out[2] + pos[2]);
+            int g3 = decode_multi(dt, &br[3], out[3] + pos[3]);
+            if ((g0 | g1 | g2 | g3) < 0) {
+                return g0 < 0 ? g0 : g1 < 0 ? g1 : g2 < 0 ? g2 : g3;
+            }
+            pos[0] += (size_t)g0;
+            pos[1] += (size_t)g1;
+            pos[2] += (size_t)g2;
+            pos[3] += (size_t)g3;
+        }
+        for (int k = 0; k < 4; ++k) {
+            int err = huf_decode_run(dt, &br[k], out[k] + pos[k], count[k] - pos[k]);
+            if (err != HUF_OK) return err;
+        }
+        return HUF_OK;
+    }
+
+    /* Segments 0..2 are equally long and segment 3 is never longer */
+    size_t common = count[3];
+    for (size_t i = 0; i < common; ++i) {
+        int s0 = decode_symbol(dt, &br[0]);
+        int s1 = decode_symbol(dt, &br[1]);
+        int s2 = decode_symbol(dt, &br[2]);
+        int s3 = decode_symbol(dt, &br[3]);
+        if ((s0 | s1 | s2 | s3) < 0) {
+            return s0 < 0 ? s0 : s1 < 0 ? s1 : s2 < 0 ? s2 : s3;
+        }
+        out[0][i] = (uint8_t)s0;
+        out[1][i] = (uint8_t)s1;
+        out[2][i] = (uint8_t)s2;
+        out[3][i] = (uint8_t)s3;
+    }
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = common; i < count[k]; ++i) {
+            int sym = decode_symbol(dt, &br[k]);
+            if (sym < 0) return sym;
+            out[k][i] = (uint8_t)sym;
+        }
+    }
+    return HUF_OK;
+}
+
+/* Decode n symbols, each with the table of the one before it; prev is
+   the context of the first */
+static int decode_order1_run(const DecodeTable *const ctx[256], BitReader *br, uint8_t *dst, size_t n,
+                             int prev) {
+    for (size_t i = 0; i < n; ++i) {
+        int sym = decode_symbol(ctx[prev], br);
+        if (sym < 0) return sym;
+        dst[i] = (uint8_t)sym;
+        prev = sym;
+    }
+    return HUF_OK;
+}
+
+/* decode_streams4 for an order-1 block: each stream keeps its own context */
+static int decode_order1_streams4(const DecodeTable *const ctx[256], const uint8_t *src, size_t len,
+                                  uint8_t *dst, size_t n) {
+    BitReader br[4];
+    uint8_t *out[4];
+    size_t count[4];
+    int err = streams4_open(src, len, dst, n, br, out, count);
+    if (err != HUF_OK) return err;
+
+    int p0 = 0, p1 = 0, p2 = 0, p3 = 0;
+    size_t common = count[3];
+    for (size_t i = 0; i < common; ++i) {
+        p0 = decode_symbol(ctx[p0], &br[0]);
+        p1 = decode_symbol(ctx[p1], &br[1]);
+        p2 = decode_symbol(ctx[p2], &br[2]);
+        p3 = decode_symbol(ctx[p3], &br[3]);
+        if ((p0 | p1 | p2 | p3) < 0) {
+            return p0 < 0 ? p0 : p1 < 0 ? p1 : p2 < 0 ? p2 : p3;
+        }
+        out[0][i] = (uint8_t)p0;
+        out[1][i] = (uint8_t)p1;
+        out[2][i] = (uint8_t)p2;
+        out[3][i] = (uint8_t)p3;
+    }
+    int prev[3] = { p0, p1, p2 };
+    for (int k = 0; k < 3; ++k) {
+        err = decode_order1_run(ctx, &br[k], out[k] + common, count[k] - common, prev[k]);
+        if (err != HUF_OK) return err;
+    }
+    return HUF_OK;
+}
+
+/* Payload of an order-1 block: table count - 1, the context map at
+   order1_map_bits() bits per context (MSB-first), the code length tables,
+   then the bitstreams as in a Huffman block. The tables live in
+   dt->order1; the multi-symbol table does not apply, since the table can
+   change after every symbol. */
+static int decode_order1(const BlockHeader *h, const uint8_t *payload, size_t len, uint8_t *dst,
+                         DecodeTable *dt, HufStats *st) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    if (len < 1) return HUF_ERR_TRUNCATED;
+    int tables = payload[0] + 1;
+    if (tables > ORDER1_MAX_TABLES) return HUF_ERR_CORRUPT;
+    int bits = order1_map_bits(tables);
+    size_t pos = 1 + 32 * (size_t)bits;
+    if (pos > len) return HUF_ERR_TRUNCATED;
+    uint8_t map[256] = {0};
+    if (bits) {
+        BitReader br;
+        br_init_mem(&br, payload + 1, pos - 1);
+        for (int c = 0; c < 256; ++c) {
+            br_refill(&br);
+            map[c] = (uint8_t)br_peek_bits(&br, bits);
+            br_skip_bits(&br, bits);
+            if (map[c] >= tables) return HUF_ERR_CORRUPT;
+        }
+    }
+
+    if (!dt->order1) {
+        if (dt->fixed) return HUF_ERR_MEMORY;
+        dt->order1 = (DecodeTable*)malloc(ORDER1_MAX_TABLES * sizeof(DecodeTable));
+        if (!dt->order1) return HUF_ERR_MEMORY;
+        for (int j = 0; j < ORDER1_MAX_TABLES; ++j) huf_decode_table_init(&dt->order1[j]);
+    }
+    Code table[ORDER1_MAX_TABLES][256];
+    for (int j = 0; j < tables; ++j) {
+        uint8_t lens[256];
+        size_t used = huf_unpack_code_lengths(payload + pos, len - pos, lens);
+        if (used == 0) return HUF_ERR_TRUNCATED;
+        if (!huf_code_lengths_valid(lens)) return HUF_ERR_CORRUPT;
+        pos += used;
+        huf_assign_canonical_codes(lens, table[j]);
+        int err = huf_decode_table_build(&dt->order1[j], table[j], 0);
+        if (err != HUF_OK) return err;
+    }
+    const DecodeTable *ctx[256];
+    for (int c = 0; c < 256; ++c) ctx[c] = &dt->order1[map[c]];
+    huf_stats_lap(st, PH_TABLE, &t);
+
+    int err;
+    if (h->flags & BF_STREAMS4) {
+        err = decode_order1_streams4(ctx, payload + pos, len - pos, dst, h->original_size);
+    } else {
+        BitReader br;
+        br_init_mem(&br, payload + pos, len - pos);
+        err = decode_order1_run(ctx, &br, dst, h->original_size, 0);
+    }
+    if (st && err == HUF_OK) {
+        huf_stats_lap(st, PH_CODE, &t);
+        uint32_t freq[ORDER1_MAX_TABLES][256];
+        memset(freq, 0, sizeof(freq));
+        order1_count(dst, h->original_size, (h->flags & BF_STREAMS4) != 0, map, freq);
+        for (int j = 0; j < tables; ++j) huf_stats_add_codes(st, freq[j], table[j]);
+        st->blocks[BT_ORDER1]++;
+    }
+    return err;
+}
+
+static int decode_payload(const BlockHeader *h, const uint8_t *payload, size_t len, uint8_t *dst,
+                          DecodeTable *dt, int multi, HufStats *st);
+
+/* Read e (0..31) extra bits */
+static int lz_get_bits(BitReader *br, int e, uint32_t *v) {
+    *v = 0;
+    if (e == 0) return HUF_OK;
+    br_refill(br);
+    if (br->bits < e) return HUF_ERR_TRUNCATED;
+    *v = br_peek_bits(br, e);
+    br_skip_bits(br, e);
+    return HUF_OK;
+}
+
+static int lz_get_length(BitReader *br, int code, uint32_t *v) {
+    if (code < 16) {
+        *v = (uint32_t)code;
+        return HUF_OK;
+    }
+    int e = code - 12;
+    if (e > 31) return HUF_ERR_CORRUPT;
+    int err = lz_get_bits(br, e, v);
+    *v |= 1u << e;
+    return err;
+}
+
+/* Payload of an LZ77 block: sequence count S, the nested literal, ll, ml
+   and offset blocks, then the extra bits. The literals are decoded into
+   the tail of dst and moved forward as the sequences run, which never
+   overtakes them: the output ends where the unread literals start. */
+static int decode_lz77(const BlockHeader *h, const uint8_t *payload, size_t len, uint8_t *dst,
+                       DecodeTable *dt, int multi, HufStats *st) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    size_t n = h->original_size;
+    if (h->flags & BF_STREAMS4) return HUF_ERR_CORRUPT;
+    if (len < 4) return HUF_ERR_TRUNCATED;
+    size_t nseq = load_le32(payload), pos = 4;
+    if (nseq > n / LZ_MIN_MATCH) return HUF_ERR_CORRUPT;
+
+    BlockHeader nh[LZ_STREAMS];
+    const uint8_t *np[LZ_STREAMS];
+    for (int k = 0; k < LZ_STREAMS; ++k) {
+        if (len - pos < BLOCK_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+        load_block_header(payload + pos, &nh[k]);
+        pos += BLOCK_HEADER_SIZE;
+        if (nh[k].payload_size > len - pos) return HUF_ERR_TRUNCATED;
+        np[k] = payload + pos;
+        pos += nh[k].payload_size;
+        if (nh[k].type == BT_LZ77 || (nh[k].flags & ~BF_STREAMS4) ||
+            (k == LZ_LITERALS ? nh[k].original_size > n : nh[k].original_size != nseq)) {
+            return HUF_ERR_CORRUPT;
+        }
+    }
+    size_t nlits = nh[LZ_LITERALS].original_size;
+    uint8_t *codes = decode_work(dt, 1, 3 * nseq);
+    if (!codes && nseq) return HUF_ERR_MEMORY;
+    int err = decode_payload(&nh[LZ_LITERALS], np[LZ_LITERALS], nh[LZ_LITERALS].payload_size,
+                             dst + n - nlits, dt, multi, NULL);
+    for (int k = LZ_LL; k < LZ_STREAMS && err == HUF_OK; ++k) {
+        err = decode_payload(&nh[k], np[k], nh[k].payload_size, codes + (size_t)(k - 1) * nseq, dt, multi, NULL);
+    }
+    if (err != HUF_OK) return err;
+    huf_stats_lap(st, PH_CODE, &t);
+
+    BitReader br;
+    br_init_mem(&br, payload + pos, len - pos);
+    size_t o = 0, r = n - nlits;
+    for (size_t s = 0; s < nseq; ++s) {
+        uint32_t ll, ml, off;
+        int oc = codes[2 * nseq + s];
+        if ((err = lz_get_length(&br, codes[s], &ll)) != HUF_OK) return err;
+        if ((err = lz_get_length(&br, codes[nseq + s], &ml)) != HUF_OK) return err;
+        if (oc > 31) return HUF_ERR_CORRUPT;
+        if ((err = lz_get_bits(&br, oc, &off)) != HUF_OK) return err;
+        off |= 1u << oc;
+        if (ll > n - r) return HUF_ERR_CORRUPT;
+        memmove(dst + o, dst + r, ll);
+        o += ll;
+        r += ll;
+        if (r - o < LZ_MIN_MATCH || ml > r - o - LZ_MIN_MATCH || off > o) return HUF_ERR_CORRUPT;
+        /* an overlapping copy repeats the last off bytes: copy from the
+           same start with a distance that doubles, always a multiple of off */
+        size_t m = (size_t)ml + LZ_MIN_MATCH, done = 0, step = off;
+        while (done < m) {
+            size_t c = m - done < step ? m - done : step;
+            memcpy(dst + o + done, dst + o - off, c);
+            done += c;
+            step += c;
+        }
+        o += m;
+    }
+    if (o != r) return HUF_ERR_CORRUPT;
+    if (st) {
+        huf_stats_lap(st, PH_TRANSFORM, &t);
+        stats_add_plain(st, dst, n, BT_LZ77);
+    }
+    return HUF_OK;
+}
+
+/* huf_decode_block on a payload of len bytes, checksum excluded */
+static int decode_payload(const BlockHeader *h, const uint8_t *payload, size_t len, uint8_t *dst,
+                          DecodeTable *dt, int multi, HufStats *st) {
+    uint64_t t = st ? huf_now_ns() : 0;
+    if (h->type == BT_RAW || h->type == BT_RLE) {
+        if ((h->flags & BF_STREAMS4) || len != (h->type == BT_RAW ? h->original_size : 1)) {
+            return HUF_ERR_CORRUPT;
+        }
+        if (h->type == BT_RAW) memcpy(dst, payload, h->original_size);
+        else memset(dst, payload[0], h->original_size);
+        if (st) {
+            huf_stats_lap(st, PH_CODE, &t);
+            stats_add_plain(st, dst, h->original_size, h->type);
+        }
+        return HUF_OK;
+    }
+    if (h->type == BT_ORDER1) return decode_order1(h, payload, len, dst, dt, st);
+    if (h->type == BT_LZ77) return decode_lz77(h, payload, len, dst, dt, multi, st);
+    if (h->type != BT_HUFFMAN) return HUF_ERR_CORRUPT;
+
+    uint8_t lens[256];
+    size_t used = huf_unpack_code_lengths(payload, len, lens);
+    if (used == 0) return HUF_ERR_TRUNCATED;
+    if (!huf_code_lengths_valid(lens)) return HUF_ERR_CORRUPT;
+
+    Code table[256];
+    huf_assign_canonical_codes(lens, table);
+    int err = huf_decode_table_build(dt, table, multi);
+    if (err != HUF_OK) return err;
+    huf_stats_lap(st, PH_TABLE, &t);
+
+    if (h->flags & BF_STREAMS4) {
+        err = decode_streams4(dt, payload + used, len - used, dst, h->original_size);
+    } else {
+        err = decode_stream(dt, payload + used, len - used, dst, h->original_size);
+    }
+    if (st && err == HUF_OK) {
+        huf_stats_lap(st, PH_CODE, &t);
+        uint32_t freq[256] = {0};
+        huf_histogram(dst, h->original_size, freq);
+        huf_stats_add_codes(st, freq, table);
+        st->blocks[BT_HUFFMAN]++;
+    }
+    return err;
+}
+
+int huf_decode_block(const BlockHeader *h, const uint8_t *payload, uint8_t *dst,
+                     DecodeTable *dt, int flags, HufStats *st) {
+    if ((h->flags & ~BF_KNOWN) != 0) return HUF_ERR_CORRUPT;
+    size_t len = h->payload_size;
+    if (h->flags & BF_CRC32C) {
+        if (len < BLOCK_CHECKSUM_SIZE) return HUF_ERR_CORRUPT;
+        len -= BLOCK_CHECKSUM_SIZE;
+    }
+    int err;
+    if (h->flags & BF_RLE4) {
+        /* the payload codes the RLE4 form, whose size comes first */
+        if (len < 4) return HUF_ERR_TRUNCATED;
+        BlockHeader inner = *h;
+        inner.flags &= (uint8_t)~(BF_RLE4 | BF_CRC32C);
+        inner.original_size = load_le32(payload);
+        if (inner.original_size > rle4_bound(h->original_size)) return HUF_ERR_CORRUPT;
+        uint8_t *runs = decode_work(dt, 0, inner.original_size);
+        if (!runs && inner.original_size) return HUF_ERR_MEMORY;
+        err = decode_payload(&inner, payload + 4, len - 4, runs, dt, flags & BLOCK_DECODE_MULTI, NULL);
+        if (err == HUF_OK) {
+            uint64_t t = st ? huf_now_ns() : 0;
+            err = rle4_decode(runs, inner.original_size, dst, h->original_size);
+            huf_stats_lap(st, PH_TRANSFORM, &t);
+            if (st && err == HUF_OK) stats_add_plain(st, dst, h->original_size, h->type);
+        }
+    } else {
+        err = decode_payload(h, payload, len, dst, dt, flags & BLOCK_DECODE_MULTI, st);
+    }
+    if (err == HUF_OK && (flags & BLOCK_DECODE_VERIFY) && (h->flags & BF_CRC32C) &&
+        huf_crc32c(dst, h->original_size) != load_le32(payload + len)) {
+        return HUF_ERR_CHECKSUM;
+    }
+    return err;
+}
+
+/* The next n bytes of arena, if there is one; *used counts them */
+static void *reserve_take(uint8_t *arena, size_t *used, size_t n) {
+    void *p = arena ? arena + *used : NULL;
+    *used += (n + 15) & ~(size_t)15;
+    return p;
+}
+
+static void reserve_table(DecodeTable *dt, DecodeEntry *entries) {
+    huf_decode_table_init(dt);
+    dt->entries = entries;
+    dt->cap = DECODE_FIXED_ENTRIES;
+    dt->fixed = 1;
+}
+
+size_t huf_decode_table_reserve(DecodeTable *dt, uint8_t *arena, size_t block_size, int what) {
+    size_t used = 0, entries = DECODE_FIXED_ENTRIES * sizeof(DecodeEntry);
+    DecodeEntry *e = (DecodeEntry*)reserve_take(arena, &used, entries);
+    uint32_t *m = (uint32_t*)reserve_take(arena, &used, ((size_t)1 << DECODE_ROOT_BITS) * sizeof(uint32_t));
+    if (dt) {
+        reserve_table(dt, e);
+        dt->multi_buf = m;
+    }
+    if (what & RESERVE_ORDER1) {
+        DecodeTable *o = (DecodeTable*)reserve_take(arena, &used, ORDER1_MAX_TABLES * sizeof(DecodeTable));
+        for (int j = 0; j < ORDER1_MAX_TABLES; ++j) {
+            DecodeEntry *oe = (DecodeEntry*)reserve_take(arena, &used, entries);
+            if (dt) reserve_table(&o[j], oe);
+        }
+        if (dt) dt->order1 = o;
+    }
+    if (what & RESERVE_TRANSFORMS) {
+        /* an LZ77 block may sit inside an RLE4 one, so its codes are
+           bounded by the RLE4 size */
+        size_t runs = rle4_bound(block_size), codes = 3 * (runs / LZ_MIN_MATCH);
+        uint8_t *w0 = (uint8_t*)reserve_take(arena, &used, runs);
+        uint8_t *w1 = (uint8_t*)reserve_take(arena, &used, codes);
+        if (dt) {
+            dt->work[0] = w0;
+            dt->work_cap[0] = runs;
+            dt->work[1] = w1;
+            dt->work_cap[1] = codes;
+        }
+    }
+    return used;
+}
+
+/* -------------------- Public API -------------------- */
+
+struct HuffCCtx {
+    HuffParams params;
+    uint8_t *scratch;  /* one worst-case block, for when dst is nearly full */
+};
+
+struct HuffDCtx {
+    DecodeTable dt;
+    uint8_t *scratch;  /* one block, for ranges that start or end inside it */
+    size_t scratch_cap;
+};
+
+const char *huff_error_string(int err) {
+    switch (err) {
+        case HUF_OK:            return "Success.";
+        case HUF_ERR_TRUNCATED: return "Unexpected end of encoded data.";
+        case HUF_ERR_FORMAT:    return "Not a HUF2/HUF3 stream (bad magic).";
+        case HUF_ERR_DST_SIZE:  return "Destination buffer too small.";
+        case HUF_ERR_PARAM:     return "Invalid parameter.";
+        case HUF_ERR_MEMORY:    return "Out of memory.";
+        case HUF_ERR_DICTIONARY: return "Wrong or missing dictionary.";
+        case HUF_ERR_CHECKSUM:  return "Block checksum mismatch: the data is damaged.";
+        default:                return "Corrupt Huffman tree or data.";
+    }
+}
+
+void huff_params_default(HuffParams *params) {
+    params->block_size = DEFAULT_BLOCK_SIZE;
+    params->max_code_len = DEFAULT_MAX_CODE_LEN;
+    params->streams = 4;
+    params->checksum = 0;
+    params->order1 = 0;
+    params->transforms = 0;
+    params->adaptive = 0;
+}
+
+int huff_params_check(const HuffParams *params) {
+    if (params->block_size < MIN_BLOCK_SIZE || params->block_size > MAX_BLOCK_SIZE ||
+        params->max_code_len < MIN_MAX_CODE_LEN || params->max_code_len > MAX_CODE_LEN ||
+        (params->streams != 1 && params->streams != 4) || (params->checksum != 0 && params->checksum != 1) ||
+        (params->order1 != 0 && params->order1 != 1) || (params->adaptive != 0 && params->adaptive != 1) ||
+        (params->transforms & ~(HUFF_TRANSFORM_RLE | HUFF_TRANSFORM_LZ77)) != 0) {
+        return HUF_ERR_PARAM;
+    }
+    return HUF_OK;
+}
+
+size_t huff_compress_bound(size_t src_len, const HuffParams *params) {
+    HuffParams def;
+    if (!params) {
+        huff_params_default(&def);
+        params = &def;
+    }
+    if (huff_params_check(params) != HUF_OK) return 0;
+    size_t full = src_len / params->block_size, tail = src_len % params->block_size;
+    int adaptive = params->adaptive;
+    size_t blocks = full * split_max_blocks(params->block_size, adaptive) +
+                    (tail ? split_max_blocks(tail, adaptive) : 0);
+    return FILE_HEADER_SIZE + full * split_bound(params->block_size, adaptive) +
+           (tail ? split_bound(tail, adaptive) : 0) + BLOCK_HEADER_SIZE + blocks * INDEX_ENTRY_SIZE +
+           TRAILER_SIZE;
+}
+
+HuffCCtx *huff_cctx_create(const HuffParams *params) {
+    HuffCCtx *cctx = (HuffCCtx*)malloc(sizeof(HuffCCtx));
+    if (!cctx) return NULL;
+    if (params) {
+        cctx->params = *params;
+    } else {
+        huff_params_default(&cctx->params);
+    }
+    cctx->scratch = NULL;
+    if (huff_params_check(&cctx->params) != HUF_OK) {
+        free(cctx);
+        return NULL;
+    }
+    return cctx;
+}
+
+void huff_cctx_free(HuffCCtx *cctx) {
+    if (!cctx) return;
+    free(cctx->scratch);
+    free(cctx);
+}
+
+/* The index is rebuilt from the block headers already in dst, so nothing
+   has to be remembered while the blocks are written. */
+static void write_index_mem(uint8_t *dst, size_t index_offset, size_t blocks, uint64_t total) {
+    BlockHeader h = { BT_INDEX, 0, (uint32_t)blocks, (uint32_t)(blocks * INDEX_ENTRY_SIZE) };
+    store_block_header(dst + index_offset, &h);
+    uint8_t *e = dst + index_offset + BLOCK_HEADER_SIZE;
+    for (size_t off = FILE_HEADER_SIZE; off < index_offset; e += INDEX_ENTRY_SIZE) {
+        BlockHeader bh;
+        load_block_header(dst + off, &bh);
+        uint32_t stored = BLOCK_HEADER_SIZE + bh.payload_size;
+        store_le64(e, off);
+        store_le32(e + 8, bh.original_size);
+        store_le32(e + 12, stored);
+        off += stored;
+    }
+    store_le64(e, index_offset);
+    store_le64(e + 8, total);
+    memcpy(e + 16, MAGIC_TRAILER, 4);
+}
+
+int huff_compress_ctx(HuffCCtx *cctx, const void *src, size_t src_len,
+                      void *dst, size_t dst_cap, size_t *dst_len) {
+    const HuffParams *p = &cctx->params;
+    const uint8_t *in = (const uint8_t*)src;
+    uint8_t *out = (uint8_t*)dst;
+    if (dst_cap < FILE_HEADER_SIZE) return HUF_ERR_DST_SIZE;
+    memcpy(out, MAGIC_V3, 4);
+    store_le32(out + 4, (uint32_t)p->block_size);
+
+    size_t pos = FILE_HEADER_SIZE, blocks = 0;
+    BlockSplit split;
+    for (size_t done = 0; done < src_len;) {
+        size_t n = src_len - done < p->block_size ? src_len - done : p->block_size;
+        size_t size;
+        if (dst_cap - pos >= split_bound(n, p->adaptive)) {
+            size = huf_encode_blocks(in + done, n, out + pos, p, NULL, &split);
+        } else {
+            /* Might not fit: encode aside and copy if it does */
+            if (!cctx->scratch) {
+                cctx->scratch = (uint8_t*)malloc(split_bound(p->block_size, p->adaptive));
+                if (!cctx->scratch) return HUF_ERR_MEMORY;
+            }
+            size = huf_encode_blocks(in + done, n, cctx->scratch, p, NULL, &split);
+            if (size > dst_cap - pos) return HUF_ERR_DST_SIZE;
+            memcpy(out + pos, cctx->scratch, size);
+        }
+        pos += size;
+        done += n;
+        blocks += split.count;
+    }
+
+    size_t index_size = BLOCK_HEADER_SIZE + blocks * INDEX_ENTRY_SIZE + TRAILER_SIZE;
+    if (dst_cap - pos < index_size) return HUF_ERR_DST_SIZE;
+    write_index_mem(out, pos, blocks, src_len);
+    *dst_len = pos + index_size;
+    return HUF_OK;
+}
+
+int huff_compress(const void *src, size_t src_len, void *dst, size_t dst_cap, size_t *dst_len) {
+    HuffCCtx cctx;
+    huff_params_default(&cctx.params);
+    cctx.scratch = NULL;
+    int err = huff_compress_ctx(&cctx, src, src_len, dst, dst_cap, dst_len);
+    free(cctx.scratch);
+    return err;
+}
+
+static void dctx_init(HuffDCtx *dctx) {
+    huf_decode_table_init(&dctx->dt);
+    dctx->scratch = NULL;
+    dctx->scratch_cap = 0;
+}
+
+static void dctx_release(HuffDCtx *dctx) {
+    huf_decode_table_free(&dctx->dt);
+    free(dctx->scratch);
+}
+
+HuffDCtx *huff_dctx_create(void) {
+    HuffDCtx *dctx = (HuffDCtx*)malloc(sizeof(HuffDCtx));
+    if (dctx) dctx_init(dctx);
+    return dctx;
+}
+
+void huff_dctx_free(HuffDCtx *dctx) {
+    if (!dctx) return;
+    dctx_release(dctx);
+    free(dctx);
+}
+
+/* Dictionary file: "HUFT", [4] ID, code length table (every byte coded).
+   Dictionary-coded message: "HUFD", [4] ID, original size as a LEB128
+   varint, then one bitstream. The ID is an FNV-1a hash of the code
+   lengths, so equal tables get equal IDs. */
+#define DICT_HEADER_SIZE 8
+#define DICT_MSG_HEADER_MAX (8 + 10)
+
+struct HuffDict {
+    uint32_t id;
+    int max_len;
+    Code table[256];
+    DecodeTable dt;
+};
+
+static uint32_t dict_id_of(const uint8_t lens[256]) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 256; ++i) h = (h ^ lens[i]) * 16777619u;
+    return h;
+}
+
+/* Parse a message header. Returns HUF_OK with *used set to its size. */
+static int dict_message_header(const uint8_t *src, size_t len, uint32_t *id, uint64_t *size, size_t *used) {
+    if (len < DICT_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+    *id = load_le32(src + 4);
+    uint64_t v = 0;
+    size_t pos = DICT_HEADER_SIZE;
+    for (int shift = 0;; shift += 7) {
+        if (pos == len) return HUF_ERR_TRUNCATED;
+        if (shift > 63) return HUF_ERR_CORRUPT;
+        uint8_t b = src[pos++];
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+    *size = v;
+    *used = pos;
+    return HUF_OK;
+}
+
+size_t huf_dict_from_counts(const uint64_t counts[256], int max_code_len, uint8_t *dst) {
+    /* Scale so the tree's uint32 weights cannot overflow, then add one to
+       every count: a message may hold bytes the samples never had */
+    uint64_t max = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (counts[i] > max) max = counts[i];
+    }
+    int shift = 0;
+    while ((max >> shift) >= ((uint64_t)1 << 23)) shift++;
+    uint32_t freq[256];
+    for (int i = 0; i < 256; ++i) freq[i] = (uint32_t)(counts[i] >> shift) + 1;
+
+    Code table[256];
+    huf_build_code_table(freq, table, max_code_len);
+    uint8_t lens[256];
+    for (int i = 0; i < 256; ++i) lens[i] = table[i].len;
+    memcpy(dst, MAGIC_DICT, 4);
+    store_le32(dst + 4, dict_id_of(lens));
+    return DICT_HEADER_SIZE + huf_pack_code_lengths(lens, dst + DICT_HEADER_SIZE);
+}
+
+int huff_dict_train(const void *samples, size_t samples_len, int max_code_len,
+                    void *dict, size_t dict_cap, size_t *dict_len) {
+    if (max_code_len == 0) max_code_len = DEFAULT_MAX_CODE_LEN;
+    if (max_code_len < MIN_MAX_CODE_LEN || max_code_len > MAX_CODE_LEN) return HUF_ERR_PARAM;
+    if (dict_cap < HUFF_DICT_MAX_SIZE) return HUF_ERR_DST_SIZE;
+    uint64_t counts[256] = {0};
+    const uint8_t *s = (const uint8_t*)samples;
+    for (size_t done = 0; done < samples_len;) {
+        /* uint32 counts per chunk */
+        size_t n = samples_len - done < MAX_BLOCK_SIZE ? samples_len - done : MAX_BLOCK_SIZE;
+        uint32_t freq[256] = {0};
+        huf_histogram(s + done, n, freq);
+        for (int i = 0; i < 256; ++i) counts[i] += freq[i];
+        done += n;
+    }
+    *dict_len = huf_dict_from_counts(counts, max_code_len, (uint8_t*)dict);
+    return HUF_OK;
+}
+
+HuffDict *huff_dict_create(const void *dict, size_t dict_len) {
+    const uint8_t *s = (const uint8_t*)dict;
+    uint8_t lens[256];
+    if (dict_len < DICT_HEADER_SIZE || memcmp(s, MAGIC_DICT, 4) != 0) return NULL;
+    if (huf_unpack_code_lengths(s + DICT_HEADER_SIZE, dict_len - DICT_HEADER_SIZE, lens) == 0) return NULL;
+    if (!huf_code_lengths_valid(lens) || dict_id_of(lens) != load_le32(s + 4)) return NULL;
+
+    HuffDict *d = (HuffDict*)malloc(sizeof(HuffDict));
+    if (!d) return NULL;
+    d->id = load_le32(s + 4);
+    d->max_len = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (!lens[i]) {
+            free(d);
+            return NULL;
+        }
+        if (lens[i] > d->max_len) d->max_len = lens[i];
+    }
+    huf_assign_canonical_codes(lens, d->table);
+    huf_decode_table_init(&d->dt);
+    if (huf_decode_table_build(&d->dt, d->table, 1) != HUF_OK) {
+        huff_dict_free(d);
+        return NULL;
+    }
+    return d;
+}
+
+void huff_dict_free(HuffDict *dict) {
+    if (!dict) return;
+    huf_decode_table_free(&dict->dt);
+    free(dict);
+}
+
+uint32_t huff_dict_id(const HuffDict *dict) {
+    return dict->id;
+}
+
+int huff_get_dict_id(const void *src, size_t src_len, uint32_t *id) {
+    const uint8_t *s = (const uint8_t*)src;
+    if (src_len < 4) return HUF_ERR_TRUNCATED;
+    if (memcmp(s, MAGIC_DICT_MSG, 4) != 0) return HUF_ERR_FORMAT;
+    if (src_len < DICT_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+    *id = load_le32(s + 4);
+    return HUF_OK;
+}
+
+size_t huff_dict_compress_bound(const HuffDict *dict, size_t src_len) {
+    return DICT_MSG_HEADER_MAX + (src_len * (size_t)dict->max_len + 7) / 8;
+}
+
+int huff_compress_dict(const HuffDict *dict, const void *src, size_t src_len,
+                       void *dst, size_t dst_cap, size_t *dst_len) {
+    const uint8_t *in = (const uint8_t*)src;
+    uint8_t *out = (uint8_t*)dst;
+    uint8_t hdr[DICT_MSG_HEADER_MAX];
+    memcpy(hdr, MAGIC_DICT_MSG, 4);
+    store_le32(hdr + 4, dict->id);
+    size_t hn = DICT_HEADER_SIZE;
+    uint64_t v = src_len;
+    do {
+        hdr[hn++] = (uint8_t)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+
+    if (dst_cap < huff_dict_compress_bound(dict, src_len)) {
+        /* Count the exact size first rather than write past dst */
+        uint64_t bits = 0;
+        for (size_t i = 0; i < src_len; ++i) bits += dict->table[in[i]].len;
+        if (dst_cap < hn || (dst_cap - hn) < (bits + 7) / 8) return HUF_ERR_DST_SIZE;
+    }
+    memcpy(out, hdr, hn);
+    BitWriter bw;
+    bw_init_mem(&bw, out + hn, dst_cap - hn);
+    for (size_t i = 0; i < src_len; ++i) {
+        bw_write_bits(&bw, dict->table[in[i]].code, dict->table[in[i]].len);
+    }
+    bw_flush(&bw);
+    *dst_len = hn + bw.pos;
+    return HUF_OK;
+}
+
+int huff_decompress_dict(const HuffDict *dict, const void *src, size_t src_len,
+                         void *dst, size_t dst_cap, size_t *dst_len) {
+    const uint8_t *s = (const uint8_t*)src;
+    if (src_len < 4) return HUF_ERR_TRUNCATED;
+    if (memcmp(s, MAGIC_DICT_MSG, 4) != 0) return HUF_ERR_FORMAT;
+    uint32_t id;
+    uint64_t size;
+    size_t used;
+    int err = dict_message_header(s, src_len, &id, &size, &used);
+    if (err != HUF_OK) return err;
+    if (id != dict->id) return HUF_ERR_DICTIONARY;
+    if (size > dst_cap) return HUF_ERR_DST_SIZE;
+    BitReader br;
+    br_init_mem(&br, s + used, src_len - used);
+    err = huf_decode_run(&dict->dt, &br, (uint8_t*)dst, (size_t)size);
+    if (err != HUF_OK) return err;
+    *dst_len = (size_t)size;
+    return HUF_OK;
+}
+
+/* Bytes an index of blocks entries and its trailer take: the gap an
+   earlier index leaves among the blocks of an appended-to archive */
+static uint64_t index_span(size_t blocks) {
+    return BLOCK_HEADER_SIZE + (uint64_t)blocks * INDEX_ENTRY_SIZE + TRAILER_SIZE;
+}
+
+/* Non-zero if the trailer that ends at src + pos is followed by blocks
+   --append wrote, not by the end or by another sequence's magic (which
+   no block header starts like) */
+static int appended_blocks_follow(const uint8_t *src, size_t len, size_t pos) {
+    return pos < len && (len - pos < 4 || memcmp(src + pos, MAGIC_V3, 4) != 0);
+}
+
+/* Walk the block headers of the HUF3 sequence at src to its last trailer,
+   for its total and the bytes it takes */
+static int sequence_size_mem(const uint8_t *src, size_t len, uint64_t *size, size_t *used) {
+    if (len < FILE_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+    if (memcmp(src, MAGIC_V3, 4) != 0) return HUF_ERR_CORRUPT;
+    size_t pos = FILE_HEADER_SIZE;
+    BlockHeader h;
+    for (;;) {
+        if (len - pos < BLOCK_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+        load_block_header(src + pos, &h);
+        if (h.payload_size > len - pos - BLOCK_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+        pos += BLOCK_HEADER_SIZE + (size_t)h.payload_size;
+        if (h.type != BT_INDEX) continue;
+        if (len - pos < TRAILER_SIZE) return HUF_ERR_TRUNCATED;
+        if (memcmp(src + pos + 16, MAGIC_TRAILER, 4) != 0) return HUF_ERR_CORRUPT;
+        *size = load_le64(src + pos + 8);
+        pos += TRAILER_SIZE;
+        if (!appended_blocks_follow(src, len, pos)) break;
+    }
+    *used = pos;
+    return HUF_OK;
+}
+
+int huff_decompressed_size(const void *src, size_t src_len, uint64_t *size) {
+    const uint8_t *s = (const uint8_t*)src;
+    if (src_len < 4) return HUF_ERR_TRUNCATED;
+    if (memcmp(s, MAGIC_V2, 4) == 0) {
+        if (src_len < 12) return HUF_ERR_TRUNCATED;
+        *size = load_le64(s + 4);
+        return HUF_OK;
+    }
+    if (memcmp(s, MAGIC_DICT_MSG, 4) == 0) {
+        uint32_t id;
+        size_t used;
+        return dict_message_header(s, src_len, &id, size, &used);
+    }
+    if (memcmp(s, MAGIC_V3, 4) != 0) return HUF_ERR_FORMAT;
+    if (src_len < FILE_HEADER_SIZE + BLOCK_HEADER_SIZE + TRAILER_SIZE) return HUF_ERR_TRUNCATED;
+    const uint8_t *t = s + src_len - TRAILER_SIZE;
+    if (memcmp(t + 16, MAGIC_TRAILER, 4) != 0) return HUF_ERR_TRUNCATED;
+    /* one sequence: the trailer leads to the index just before it */
+    uint64_t index_offset = load_le64(t);
+    if (index_offset <= src_len - TRAILER_SIZE - BLOCK_HEADER_SIZE) {
+        BlockHeader ih;
+        load_block_header(s + index_offset, &ih);
+        if (ih.type == BT_INDEX && index_offset + BLOCK_HEADER_SIZE + ih.payload_size + TRAILER_SIZE == src_len) {
+            *size = load_le64(t + 8);
+            return HUF_OK;
+        }
+    }
+    /* concatenated sequences add up */
+    uint64_t total = 0;
+    for (size_t pos = 0; pos < src_len;) {
+        uint64_t n;
+        size_t used;
+        int err = sequence_size_mem(s + pos, src_len - pos, &n, &used);
+        if (err != HUF_OK) return err;
+        total += n;
+        pos += used;
+    }
+    *size = total;
+    return HUF_OK;
+}
+
+/* HUF2: one table, one bitstream */
+static int decompress_single_mem(HuffDCtx *dctx, const uint8_t *src, size_t len,
+                                 uint8_t *dst, size_t cap, size_t *dst_len) {
+    if (len < 12) return HUF_ERR_TRUNCATED;
+    uint64_t size = load_le64(src + 4);
+    size_t need = huf_code_lengths_size(src + 12, len - 12);
+    if (need == 0) return HUF_ERR_CORRUPT;
+    if (need > len - 12) return HUF_ERR_TRUNCATED;
+    uint8_t lens[256];
+    if (huf_unpack_code_lengths(src + 12, len - 12, lens) == 0) return HUF_ERR_CORRUPT;
+    if (size > cap) return HUF_ERR_DST_SIZE;
+    if (size > 0) {
+        if (!huf_code_lengths_valid(lens)) return HUF_ERR_CORRUPT;
+        Code table[256];
+        huf_assign_canonical_codes(lens, table);
+        int err = huf_decode_table_build(&dctx->dt, table, 1);
+        if (err != HUF_OK) return err;
+        BitReader br;
+        br_init_mem(&br, src + 12 + need, len - 12 - need);
+        err = huf_decode_run(&dctx->dt, &br, dst, (size_t)size);
+        if (err != HUF_OK) return err;
+    }
+    *dst_len = (size_t)size;
+    return HUF_OK;
+}
+
+/* Check the index at src[pos..) and the trailer against the blocks that
+   were just decoded, stepping over earlier indexes, and store where the
+   trailer ends in *end */
+static int check_index_mem(const uint8_t *src, size_t len, size_t pos, size_t blocks, uint64_t total,
+                           size_t *end) {
+    BlockHeader h;
+    load_block_header(src + pos, &h);
+    if (h.flags != 0 || h.original_size != blocks || h.payload_size != blocks * INDEX_ENTRY_SIZE) {
+        return HUF_ERR_CORRUPT;
+    }
+    *end = pos + BLOCK_HEADER_SIZE + h.payload_size + TRAILER_SIZE;
+    if (*end > len) return HUF_ERR_TRUNCATED;
+
+    const uint8_t *e = src + pos + BLOCK_HEADER_SIZE;
+    for (size_t off = FILE_HEADER_SIZE; off < pos;) {
+        BlockHeader bh;
+        load_block_header(src + off, &bh);
+        if (bh.type == BT_INDEX) {  /* checked when it was reached */
+            off += BLOCK_HEADER_SIZE + bh.payload_size + TRAILER_SIZE;
+            continue;
+        }
+        uint32_t stored = BLOCK_HEADER_SIZE + bh.payload_size;
+        if (load_le64(e) != off || load_le32(e + 8) != bh.original_size || load_le32(e + 12) != stored) {
+            return HUF_ERR_CORRUPT;
+        }
+        off += stored;
+        e += INDEX_ENTRY_SIZE;
+    }
+    if (memcmp(e + 16, MAGIC_TRAILER, 4) != 0 || load_le64(e) != pos || load_le64(e + 8) != total) {
+        return HUF_ERR_CORRUPT;
+    }
+    return HUF_OK;
+}
+
+/* One HUF3 block sequence, from its magic to the end of its last trailer
+   at src + *used: blocks are decoded in order straight into dst, and each
+   index is checked as it is reached */
+static int decompress_sequence_mem(HuffDCtx *dctx, const uint8_t *src, size_t len,
+                                   uint8_t *dst, size_t cap, size_t *dst_len, size_t *used) {
+    if (len < FILE_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+    if (memcmp(src, MAGIC_V3, 4) != 0) return HUF_ERR_CORRUPT;
+    size_t block_size = load_le32(src + 4);
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) return HUF_ERR_CORRUPT;
+
+    size_t pos = FILE_HEADER_SIZE, out = 0, blocks = 0;
+    for (;;) {
+        if (len - pos < BLOCK_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+        BlockHeader h;
+        load_block_header(src + pos, &h);
+        if (h.type == BT_INDEX) {
+            size_t end;
+            int err = check_index_mem(src, len, pos, blocks, out, &end);
+            if (err != HUF_OK) return err;
+            pos = end;
+            if (!appended_blocks_follow(src, len, pos)) break;
+            continue;
+        }
+        if (h.original_size == 0 || h.original_size > block_size) return HUF_ERR_CORRUPT;
+        if (h.payload_size > len - pos - BLOCK_HEADER_SIZE) return HUF_ERR_TRUNCATED;
+        if (h.original_size > cap - out) return HUF_ERR_DST_SIZE;
+        int err = huf_decode_block(&h, src + pos + BLOCK_HEADER_SIZE, dst + out, &dctx->dt,
+                                   BLOCK_DECODE_MULTI | BLOCK_DECODE_VERIFY, NULL);
+        if (err != HUF_OK) return err;
+        pos += BLOCK_HEADER_SIZE + (size_t)h.payload_size;
+        out += h.original_size;
+        blocks++;
+    }
+    *used = pos;
+    *dst_len = out;
+    return HUF_OK;
+}
+
+/* HUF3: the buffer may hold several block sequences back to back, as when
+   archives are concatenated, and they decode one after another */
+static int decompress_blocks_mem(HuffDCtx *dctx, const uint8_t *src, size_t len,
+                                 uint8_t *dst, size_t cap, size_t *dst_len) {
+    size_t pos = 0, out = 0;
+    do {
+        size_t n, used;
+        int err = decompress_sequence_mem(dctx, src + pos, len - pos, dst + out, cap - out, &n, &used);
+        if (err != HUF_OK) return err;
+        pos += used;
+        out += n;
+    } while (pos < len);
+    *dst_len = out;
+    return HUF_OK;
+}
+
+int huff_decompress_ctx(HuffDCtx *dctx, const void *src, size_t src_len,
+                        void *dst, size_t dst_cap, size_t *dst_len) {
+    const uint8_t *s = (const uint8_t*)src;
+    if (src_len < 4) return HUF_ERR_TRUNCATED;
+    if (memcmp(s, MAGIC_V3, 4) == 0) {
+        return decompress_blocks_mem(dctx, s, src_len, (uint8_t*)dst, dst_cap, dst_len);
+    }
+    if (memcmp(s, MAGIC_V2, 4) == 0) {
+        return decompress_single_mem(dctx, s, src_len, (uint8_t*)dst, dst_cap, dst_len);
+    }
+    if (memcmp(s, MAGIC_DICT_MSG, 4) == 0) return HUF_ERR_DICTIONARY;
+    return HUF_ERR_FORMAT;
+}
+
+int huff_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap, size_t *dst_len) {
+    HuffDCtx dctx;
+    dctx_init(&dctx);
+    int err = huff_decompress_ctx(&dctx, src, src_len, dst, dst_cap, dst_len);
+    dctx_release(&dctx);
+    return err;
+}
+
+/* The index is walked up to the first block the range touches, so nothing
+   before it is decoded; blocks the range only partly covers go through
+   the context's scratch block. The last index is the only one read. */
+int huff_decompress_range(HuffDCtx *dctx, const void *src, size_t src_len, uint64_t offset,
+                          void *dst, size_t len, size_t *dst_len) {
+    const uint8_t *s = (const uint8_t*)src;
+    uint8_t *out = (uint8_t*)dst;
+    if (src_len < 4) return HUF_ERR_TRUNCATED;
+    if (memcmp(s, MAGIC_V3, 4) != 0) return HUF_ERR_FORMAT;
+    if (src_len < FILE_HEADER_SIZE + BLOCK_HEADER_SIZE + TRAILER_SIZE) return HUF_ERR_TRUNCATED;
+    size_t block_size = load_le32(s + 4);
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) return HUF_ERR_CORRUPT;
+
+    const uint8_t *t = s + src_len - TRAILER_SIZE;
+    if (memcmp(t + 16, MAGIC_TRAILER, 4) != 0) return HUF_ERR_TRUNCATED;
+    uint64_t index_offset = load_le64(t), total = load_le64(t + 8);
+    if (index_offset < FILE_HEADER_SIZE || index_offset > src_len - TRAILER_SIZE - BLOCK_HEADER_SIZE) {
+        return HUF_ERR_CORRUPT;
+    }
+    BlockHeader ih;
+    load_block_header(s + index_offset, &ih);
+    if (ih.type != BT_INDEX || ih.flags != 0 ||
+        (uint64_t)ih.payload_size != (uint64_t)ih.original_size * INDEX_ENTRY_SIZE ||
+        index_offset + BLOCK_HEADER_SIZE + ih.payload_size + TRAILER_SIZE != src_len) {
+        return HUF_ERR_CORRUPT;
+    }
+    if (offset > total) return HUF_ERR_PARAM;
+    if (len > total - offset) len = (size_t)(total - offset);
+
+    const uint8_t *e = s + index_offset + BLOCK_HEADER_SIZE;
+    uint64_t block_off = FILE_HEADER_SIZE, start = 0, end = offset + len;
+    size_t done = 0;
+    for (uint32_t i = 0; i < ih.original_size && start < end; ++i, e += INDEX_ENTRY_SIZE) {
+        uint32_t orig = load_le32(e + 8), stored = load_le32(e + 12);
+        if (load_le64(e) == block_off + index_span(i)) block_off = load_le64(e);  /* an earlier index */
+        if (load_le64(e) != block_off || orig == 0 || orig > block_size || stored <= BLOCK_HEADER_SIZE ||
+            stored > index_offset - block_off) {
+            return HUF_ERR_CORRUPT;
+        }
+        if (start + orig > offset) {
+            BlockHeader h;
+            load_block_header(s + block_off, &h);
+            if (h.type == BT_INDEX || h.original_size != orig || BLOCK_HEADER_SIZE + h.payload_size != stored) {
+                return HUF_ERR_CORRUPT;
+            }
+            uint64_t from = offset > start ? offset - start : 0;
+            uint64_t to = end - start < orig ? end - start : orig;
+            uint8_t *into = out + done;
+            if (from != 0 || to != orig) {
+                if (!dctx->scratch || dctx->scratch_cap < block_size) {
+                    free(dctx->scratch);
+                    dctx->scratch = (uint8_t*)malloc(block_size);
+                    dctx->scratch_cap = dctx->scratch ? block_size : 0;
+                    if (!dctx->scratch) return HUF_ERR_MEMORY;
+                }
+                into = dctx->scratch;
+            }
+            int err = huf_decode_block(&h, s + block_off + BLOCK_HEADER_SIZE, into, &dctx->dt,
+                                       BLOCK_DECODE_MULTI | BLOCK_DECODE_VERIFY, NULL);
+            if (err != HUF_OK) return err;
+            if (into != out + done) memcpy(out + done, into + from, (size_t)(to - from));
+            done += (size_t)(to - from);
+        }
+        block_off += stored;
+        start += orig;
+    }
+    if (done != len) return HUF_ERR_CORRUPT;
+    *dst_len = done;
+    return HUF_OK;
+}
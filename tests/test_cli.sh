@@ -0,0 +1,128 @@
+#!/bin/sh
+# test_cli.sh: round trips and regressions of the huff tool
+# Usage: sh tests/test_cli.sh ./huff   (make test runs it)
+
+HUFF=${1:-./huff}
+case $HUFF in /*) ;; *) HUFF=$(pwd)/$HUFF ;; esac
+DATA=$(cd "$(dirname "$0")" && pwd)/data
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+failed=0
+# under make test CFLAGS=-fsanitize=..., a sanitizer report fails the run
+UBSAN_OPTIONS=${UBSAN_OPTIONS:-halt_on_error=1}
+export UBSAN_OPTIONS
+
+fail() {
+    echo "FAIL: $*" >&2
+    failed=$((failed + 1))
+}
+
+# roundtrip <input> "<compress options>" "<decompress options>"
+roundtrip() {
+    $HUFF $2 -c "$1" rt.huf 2>/dev/null || { fail "-c $2 $1"; return; }
+    $HUFF $3 -d rt.huf rt.out 2>/dev/null || { fail "-d $3 of -c $2 $1"; return; }
+    cmp -s "$1" rt.out || fail "round trip of $1 with -c $2 / -d $3"
+}
+
+# Inputs: source text, random bytes, one repeated byte, empty
+cat "$SRC"/huffman.c "$SRC"/libhuff.c > text
+head -c 300000 /dev/urandom > random
+head -c 100000 /dev/zero | tr '\0' 'a' > same
+: > empty
+cat text random text > mixed
+
+for f in text random same empty mixed; do
+    for c in "" "--block-size 0" "--block-size 4K --streams 1" \
+             "--block-size 4K --checksum --order1 --transform rle,lz77" \
+             "--adaptive --block-size 64K" "-j 3 --block-size 16K" \
+             "--pipeline --block-size 16K"; do
+        roundtrip $f "$c" ""
+    done
+    for d in "--no-mmap" "-j 2" "--pipeline" "--decoder single" "--verify" \
+             "--mem 4M"; do
+        roundtrip $f "--block-size 16K --checksum" "$d"
+    done
+done
+$HUFF -c --block-size 0 mixed m.huf &&
+    $HUFF -d --mem 200K m.huf m.out 2>/dev/null && cmp -s mixed m.out ||
+    fail "HUF2 under --mem"
+$HUFF -d --pipeline m.huf m.out 2> warn.txt && cmp -s mixed m.out &&
+    grep -q -- --pipeline warn.txt || fail "-d --pipeline of HUF2 does not say it has no effect"
+# a cap that is too small fails before the output is created
+for f in m.huf rt.huf; do
+    rm -f small.out
+    $HUFF -d --mem 10K $f small.out 2>/dev/null && fail "-d --mem 10K of $f"
+    [ -e small.out ] && fail "-d --mem 10K of $f left an output file"
+done
+cat mixed | $HUFF -c - - | $HUFF -d - - | cmp -s mixed - || fail "stdin to stdout"
+
+# Joined files whose later parts have larger blocks than the first
+$HUFF -c --block-size 1K text j1.huf && $HUFF -c random j2.huf &&
+    $HUFF -c --block-size 64K --transform rle,lz77 text j3.huf || fail "-c of joined parts"
+cat j1.huf j2.huf j3.huf > j.huf
+cat text random text > j.want
+for d in "" "--no-mmap" "--pipeline" "--pipeline --no-mmap"; do
+    $HUFF -d $d j.huf j.out && cmp -s j.want j.out || fail "joined larger blocks, -d $d"
+    $HUFF -d $d - - < j.huf | cmp -s j.want - || fail "joined larger blocks from stdin, -d $d"
+done
+$HUFF -d --mem 1M j.huf j.out 2>/dev/null && fail "joined larger blocks under --mem"
+
+# Range decoding
+$HUFF -c --block-size 4K mixed r.huf
+$HUFF -d -r 5000:70000 r.huf r.out &&
+    tail -c +5001 mixed | head -c 70000 | cmp -s - r.out || fail "-r"
+
+# Appending: the result decodes through every reader, an empty input
+# adds nothing, and an append that fails leaves the archive as it was
+$HUFF -c --block-size 4K text ap.huf &&
+    $HUFF -c --append random ap.huf && $HUFF -c --append -j 2 text ap.huf ||
+    fail "--append"
+cat text random text > ap.want
+for d in "" "--no-mmap" "-j 2" "--pipeline" "--mem 1M"; do
+    $HUFF -d $d ap.huf ap.out 2>/dev/null && cmp -s ap.want ap.out || fail "appended archive, -d $d"
+done
+$HUFF -d - - < ap.huf | cmp -s ap.want - || fail "appended archive from stdin"
+cat ap.huf r.huf | $HUFF -d - ap.out && cat ap.want mixed | cmp -s - ap.out ||
+    fail "appended archive joined with another"
+$HUFF -d -r 300000:100000 ap.huf ap.out && tail -c +300001 ap.want | head -c 100000 | cmp -s - ap.out ||
+    fail "-r across appended blocks"
+cp ap.huf ap.bak
+$HUFF -c --append empty ap.huf && cmp -s ap.huf ap.bak || fail "appending an empty input"
+# a file size limit (in 512-byte units) stops the write some 20K in;
+# with SIGXFSZ ignored the write fails instead of killing huff
+size=$(wc -c < ap.huf)
+for j in "" "-j 2"; do
+    (ulimit -f $((size / 512 + 40)); trap '' XFSZ; $HUFF -c --append $j mixed ap.huf 2>/dev/null) &&
+        fail "--append $j past the file size limit"
+    cmp -s ap.huf ap.bak || fail "failed --append $j changed the archive"
+done
+
+# Dictionaries
+$HUFF --train t.dict text 2>/dev/null || fail "--train"
+head -c 500 text > small
+$HUFF -c --dict t.dict small s.huf &&
+    $HUFF -d --dict t.dict s.huf s.out && cmp -s small s.out || fail "dictionary round trip"
+$HUFF -d s.huf s.out 2>/dev/null && fail "dictionary input decoded without --dict"
+
+# --bench CSV quotes the name as RFC 4180 asks
+head -c 5000 text > 'a,"b'
+$HUFF --bench --iterations 1 'a,"b' > bench.csv 2>/dev/null &&
+    grep -q '^"a,""b",5000,' bench.csv || fail "--bench CSV name quoting"
+
+# Corrupt input is refused, not crashed on
+$HUFF -c --block-size 4K text c.huf
+head -c 3000 c.huf > trunc.huf
+$HUFF -d trunc.huf c.out 2>/dev/null
+[ $? -eq 1 ] || fail "truncated file not refused"
+
+# An empty HUF2 file whose (unused) code lengths run past the limit
+$HUFF -d "$DATA"/huf2-empty-long-code.huf e.out 2>/dev/null && [ ! -s e.out ] ||
+    fail "empty HUF2 with overlong code lengths"
+
+if [ $failed -ne 0 ]; then
+    echo "test_cli: $failed failed" >&2
+    exit 1
+fi
+echo "test_cli: ok"
@@ -0,0 +1,407 @@
+/* test_libhuff.c
+ * Round trips and error codes of the libhuff API (huff.h): every block
+ * type and flag the encoder can pick, dictionaries, range decoding,
+ * concatenated and appended-to buffers, and truncated or corrupt input.
+ *
+ * Build and run: make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "huff_internal.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+/* -------------------- Inputs -------------------- */
+
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+static uint32_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)(rng >> 32);
+}
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t size;
+} Sample;
+
+/* Data shaped to make the encoder pick each block type and pass */
+static void fill(const char *name, uint8_t *p, size_t n) {
+    static const char *const words[] = { "the ", "huffman ", "block ", "index ", "of ", "a ", "code ", "table " };
+    if (strcmp(name, "text") == 0) {
+        for (size_t i = 0; i < n;) {
+            const char *w = words[next_rand() % 8];
+            for (; *w && i < n; ++w) p[i++] = (uint8_t)*w;
+        }
+    } else if (strcmp(name, "random") == 0) {
+        for (size_t i = 0; i < n; ++i) p[i] = (uint8_t)next_rand();
+    } else if (strcmp(name, "one-byte") == 0) {
+        memset(p, 'z', n);
+    } else if (strcmp(name, "runs") == 0) {
+        for (size_t i = 0; i < n;) {
+            uint8_t b = (uint8_t)next_rand();
+            size_t len = 4 + next_rand() % 60;
+            for (size_t k = 0; k < len && i < n; ++k) p[i++] = b;
+        }
+    } else if (strcmp(name, "repeats") == 0) {
+        /* random phrases, each repeated: flat histogram, long matches */
+        for (size_t i = 0; i < n;) {
+            uint8_t phrase[256];
+            for (size_t k = 0; k < sizeof(phrase); ++k) phrase[k] = (uint8_t)next_rand();
+            for (int r = 0; r < 8; ++r) {
+                for (size_t k = 0; k < sizeof(phrase) && i < n; ++k) p[i++] = phrase[k];
+            }
+        }
+    } else if (strcmp(name, "markov") == 0) {
+        /* each byte one of four picked by the previous one */
+        uint8_t prev = 0;
+        for (size_t i = 0; i < n; ++i) {
+            prev = (uint8_t)(prev * 37 + 11 + 64 * (next_rand() % 4));
+            p[i] = prev;
+        }
+    } else { /* "mixed": text, then random, then text */
+        fill("text", p, n / 3);
+        fill("random", p + n / 3, n / 3);
+        fill("text", p + 2 * (n / 3), n - 2 * (n / 3));
+    }
+}
+
+/* -------------------- Helpers -------------------- */
+
+static uint64_t seen_types[BT_COUNT];
+static uint64_t seen_flags[8];
+
+/* Count the block types and flags of a single-sequence HUF3 buffer */
+static void count_blocks(const uint8_t *z, size_t len) {
+    size_t pos = FILE_HEADER_SIZE;
+    while (pos + BLOCK_HEADER_SIZE <= len) {
+        BlockHeader h;
+        load_block_header(z + pos, &h);
+        if (h.type == BT_INDEX || h.type >= BT_COUNT) break;
+        seen_types[h.type]++;
+        for (int f = 0; f < 3; ++f) {
+            if (h.flags & (1u << f)) seen_flags[f]++;
+        }
+        pos += BLOCK_HEADER_SIZE + h.payload_size;
+    }
+}
+
+static uint8_t *compress_with(const HuffParams *pr, const uint8_t *src, size_t n, size_t *len) {
+    size_t cap = huff_compress_bound(n, pr);
+    uint8_t *z = (uint8_t*)malloc(cap ? cap : 1);
+    HuffCCtx *c = huff_cctx_create(pr);
+    CHECK(c != NULL, "huff_cctx_create failed");
+    int err = huff_compress_ctx(c, src, n, z, cap, len);
+    CHECK(err == HUF_OK, "compress: %s", huff_error_string(err));
+    huff_cctx_free(c);
+    return z;
+}
+
+/* -------------------- Tests -------------------- */
+
+static void test_roundtrips(const Sample *s, int nsamples) {
+    static const size_t block_sizes[] = { 1u << 10, 64u << 10 };
+    HuffDCtx *d = huff_dctx_create();
+    for (int i = 0; i < nsamples; ++i) {
+        uint8_t *out = (uint8_t*)malloc(s[i].size + 1);
+        for (int combo = 0; combo < 2 * 2 * 2 * 2 * 4 * 2; ++combo) {
+            HuffParams pr;
+            huff_params_default(&pr);
+            int k = combo;
+            pr.block_size = block_sizes[k % 2]; k /= 2;
+            pr.streams = k % 2 ? 4 : 1; k /= 2;
+            pr.checksum = k % 2; k /= 2;
+            pr.order1 = k % 2; k /= 2;
+            pr.transforms = k % 4; k /= 4;
+            pr.adaptive = k % 2;
+            CHECK(huff_params_check(&pr) == HUF_OK, "params rejected");
+            size_t zl;
+            uint8_t *z = compress_with(&pr, s[i].data, s[i].size, &zl);
+            count_blocks(z, zl);
+
+            uint64_t size = 0;
+            int err = huff_decompressed_size(z, zl, &size);
+            CHECK(err == HUF_OK && size == s[i].size, "%s/%d: decompressed size", s[i].name, combo);
+            size_t ol = 0;
+            err = huff_decompress_ctx(d, z, zl, out, s[i].size, &ol);
+            CHECK(err == HUF_OK && ol == s[i].size && memcmp(out, s[i].data, ol) == 0,
+                  "%s/%d: round trip: %s", s[i].name, combo, huff_error_string(err));
+
+            /* a range across a block boundary */
+            if (s[i].size > 3000) {
+                size_t got = 0;
+                err = huff_decompress_range(d, z, zl, 1000, out, 2000, &got);
+                CHECK(err == HUF_OK && got == 2000 && memcmp(out, s[i].data + 1000, 2000) == 0,
+                      "%s/%d: range: %s", s[i].name, combo, huff_error_string(err));
+            }
+            free(z);
+        }
+        free(out);
+    }
+    huff_dctx_free(d);
+
+    CHECK(seen_types[BT_HUFFMAN] && seen_types[BT_RAW] && seen_types[BT_RLE] && seen_types[BT_ORDER1] &&
+          seen_types[BT_LZ77], "not every block type was written");
+    CHECK(seen_flags[0] && seen_flags[1] && seen_flags[2], "not every block flag was written");
+}
+
+static void test_dictionary(const Sample *text) {
+    uint8_t dict[HUFF_DICT_MAX_SIZE];
+    size_t dict_len;
+    CHECK(huff_dict_train(text->data, 4096, 0, dict, sizeof(dict), &dict_len) == HUF_OK, "train");
+    HuffDict *hd = huff_dict_create(dict, dict_len);
+    CHECK(hd != NULL, "huff_dict_create");
+    if (!hd) return;
+
+    const uint8_t *msg = text->data + 5000;
+    size_t n = 300, cap = huff_dict_compress_bound(hd, n), zl, ol;
+    uint8_t *z = (uint8_t*)malloc(cap), out[300];
+    CHECK(huff_compress_dict(hd, msg, n, z, cap, &zl) == HUF_OK, "compress_dict");
+    CHECK(huff_decompress_dict(hd, z, zl, out, n, &ol) == HUF_OK && ol == n && memcmp(out, msg, n) == 0,
+          "dictionary round trip");
+    uint32_t id;
+    CHECK(huff_get_dict_id(z, zl, &id) == HUF_OK && id == huff_dict_id(hd), "dictionary id");
+    uint64_t size;
+    CHECK(huff_decompressed_size(z, zl, &size) == HUF_OK && size == n, "dictionary message size");
+    CHECK(huff_decompress(z, zl, out, n, &ol) == HUF_ERR_DICTIONARY, "message without its dictionary");
+    CHECK(huff_decompress_dict(hd, z, zl, out, n - 1, &ol) == HUF_ERR_DST_SIZE, "dictionary dst size");
+    CHECK(huff_decompress_dict(hd, z, zl - 1, out, n, &ol) < 0, "truncated dictionary message");
+
+    /* a dictionary trained on other data must be refused */
+    uint8_t other[4096], dict2[HUFF_DICT_MAX_SIZE];
+    fill("random", other, sizeof(other));
+    size_t dict2_len;
+    CHECK(huff_dict_train(other, sizeof(other), 0, dict2, sizeof(dict2), &dict2_len) == HUF_OK, "train 2");
+    HuffDict *hd2 = huff_dict_create(dict2, dict2_len);
+    CHECK(hd2 && huff_decompress_dict(hd2, z, zl, out, n, &ol) == HUF_ERR_DICTIONARY, "wrong dictionary");
+    dict[dict_len / 2] ^= 0x40;
+    HuffDict *bad = huff_dict_create(dict, dict_len);
+    CHECK(bad == NULL, "corrupt dictionary accepted");
+    huff_dict_free(bad);
+    huff_dict_free(hd2);
+    huff_dict_free(hd);
+    free(z);
+}
+
+static void test_errors(const Sample *text) {
+    HuffParams pr;
+    huff_params_default(&pr);
+    pr.block_size = 1u << 10;
+    pr.checksum = 1;
+    size_t n = 5000, zl, ol;
+    uint8_t *z = compress_with(&pr, text->data, n, &zl);
+    uint8_t *out = (uint8_t*)malloc(n);
+
+    HuffParams bad = pr;
+    bad.streams = 3;
+    CHECK(huff_params_check(&bad) == HUF_ERR_PARAM, "streams 3 accepted");
+    CHECK(huff_compress_bound(n, &bad) == 0, "bound of bad params");
+    bad = pr;
+    bad.block_size = 100;
+    CHECK(huff_cctx_create(&bad) == NULL, "block size 100 accepted");
+
+    CHECK(huff_decompress(z, zl, out, n - 1, &ol) == HUF_ERR_DST_SIZE, "dst too small");
+    uint8_t tight[64];
+    CHECK(huff_compress(text->data, n, tight, sizeof(tight), &ol) == HUF_ERR_DST_SIZE, "compress dst too small");
+    CHECK(huff_decompress("HUF9xxxxxxxx", 12, out, n, &ol) == HUF_ERR_FORMAT, "bad magic");
+    CHECK(huff_decompress(z, 3, out, n, &ol) == HUF_ERR_TRUNCATED, "3 bytes");
+    HuffDCtx *d = huff_dctx_create();
+    CHECK(huff_decompress_range(d, z, zl, n + 1, out, 1, &ol) == HUF_ERR_PARAM, "range past the end");
+
+    /* every prefix is refused */
+    for (size_t len = 0; len < zl; ++len) {
+        int err = huff_decompress_ctx(d, z, len, out, n, &ol);
+        CHECK(err < 0, "prefix of %zu bytes decoded", len);
+    }
+    /* with checksums, no flipped bit may decode to other data */
+    for (size_t i = 0; i < zl; ++i) {
+        for (int bit = 0; bit < 8; bit += 3) {
+            z[i] ^= (uint8_t)(1u << bit);
+            int err = huff_decompress_ctx(d, z, zl, out, n, &ol);
+            CHECK(err < 0 || (ol == n && memcmp(out, text->data, n) == 0),
+                  "flip at %zu.%d decoded to other data", i, bit);
+            z[i] ^= (uint8_t)(1u << bit);
+        }
+    }
+    /* a block that does not match its checksum */
+    BlockHeader h;
+    load_block_header(z + FILE_HEADER_SIZE, &h);
+    z[FILE_HEADER_SIZE + BLOCK_HEADER_SIZE + h.payload_size - 1] ^= 0x10;
+    int err = huff_decompress_ctx(d, z, zl, out, n, &ol);
+    CHECK(err == HUF_ERR_CHECKSUM, "wrong checksum: %s", huff_error_string(err));
+
+    /* HUF2 header of an empty input with an out-of-range code length */
+    static const uint8_t huf2_empty[] = { 'H', 'U', 'F', '2', 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0x41, 0xc8 };
+    err = huff_decompress_ctx(d, huf2_empty, sizeof(huf2_empty), out, n, &ol);
+    CHECK(err < 0 || ol == 0, "empty HUF2 with a long code");
+
+    for (int e = HUF_ERR_CHECKSUM; e <= HUF_OK; ++e) {
+        CHECK(huff_error_string(e) && *huff_error_string(e), "no message for %d", e);
+    }
+    huff_dctx_free(d);
+    free(out);
+    free(z);
+}
+
+static void test_concatenated(const Sample *text, const Sample *random) {
+    HuffParams small, large;
+    huff_params_default(&small);
+    huff_params_default(&large);
+    small.block_size = 1u << 10;
+    large.block_size = 64u << 10;
+    size_t n1 = 20000, n2 = 30000, l1, l2;
+    uint8_t *a = compress_with(&small, text->data, n1, &l1);
+    uint8_t *b = compress_with(&large, random->data, n2, &l2);
+    uint8_t *ab = (uint8_t*)malloc(l1 + l2);
+    memcpy(ab, a, l1);
+    memcpy(ab + l1, b, l2);
+
+    uint8_t *out = (uint8_t*)malloc(n1 + n2);
+    size_t ol;
+    uint64_t size;
+    CHECK(huff_decompressed_size(ab, l1 + l2, &size) == HUF_OK && size == n1 + n2, "joined size");
+    int err = huff_decompress(ab, l1 + l2, out, n1 + n2, &ol);
+    CHECK(err == HUF_OK && ol == n1 + n2 && memcmp(out, text->data, n1) == 0 &&
+          memcmp(out + n1, random->data, n2) == 0, "joined round trip: %s", huff_error_string(err));
+    CHECK(huff_decompress(ab, l1 + l2 - 1, out, n1 + n2, &ol) < 0, "joined and truncated");
+    CHECK(huff_decompress(ab, l1 + l2, out, n1 + n2 - 1, &ol) == HUF_ERR_DST_SIZE, "joined dst size");
+    HuffDCtx *d = huff_dctx_create();
+    CHECK(huff_decompress_range(d, ab, l1 + l2, 0, out, 10, &ol) < 0, "range over joined buffers");
+    huff_dctx_free(d);
+    free(out);
+    free(ab);
+    free(b);
+    free(a);
+}
+
+/* What huff -c --append does to archive a (l1 bytes) with the blocks of b
+   (l2 bytes): b's blocks go after a's trailer, then an index of both */
+static uint8_t *append_blocks(const uint8_t *a, size_t l1, const uint8_t *b, size_t l2, size_t *len) {
+    uint64_t ia = load_le64(a + l1 - TRAILER_SIZE), ib = load_le64(b + l2 - TRAILER_SIZE);
+    uint32_t na = load_le32(a + ia + 2), nb = load_le32(b + ib + 2);
+    uint64_t total = load_le64(a + l1 - TRAILER_SIZE + 8) + load_le64(b + l2 - TRAILER_SIZE + 8);
+    size_t blocks = (size_t)ib - FILE_HEADER_SIZE;
+    size_t index_offset = l1 + blocks;
+    *len = index_offset + BLOCK_HEADER_SIZE + (size_t)(na + nb) * INDEX_ENTRY_SIZE + TRAILER_SIZE;
+    uint8_t *z = (uint8_t*)malloc(*len);
+    memcpy(z, a, l1);
+    memcpy(z + l1, b + FILE_HEADER_SIZE, blocks);
+    uint8_t *p = z + index_offset;
+    BlockHeader h = { BT_INDEX, 0, na + nb, (na + nb) * INDEX_ENTRY_SIZE };
+    store_block_header(p, &h);
+    p += BLOCK_HEADER_SIZE;
+    memcpy(p, a + ia + BLOCK_HEADER_SIZE, (size_t)na * INDEX_ENTRY_SIZE);
+    p += (size_t)na * INDEX_ENTRY_SIZE;
+    for (uint32_t i = 0; i < nb; ++i, p += INDEX_ENTRY_SIZE) {
+        memcpy(p, b + ib + BLOCK_HEADER_SIZE + (size_t)i * INDEX_ENTRY_SIZE, INDEX_ENTRY_SIZE);
+        store_le64(p, load_le64(p) - FILE_HEADER_SIZE + l1);
+    }
+    store_le64(p, index_offset);
+    store_le64(p + 8, total);
+    memcpy(p + 16, MAGIC_TRAILER, 4);
+    return z;
+}
+
+static void test_appended(const Sample *text, const Sample *random) {
+    HuffParams pr;
+    huff_params_default(&pr);
+    pr.block_size = 1u << 10;
+    pr.checksum = 1;
+    size_t n1 = 20000, n2 = 30000, n3 = 5000, l1, l2, l3, l12, l123;
+    uint8_t *a = compress_with(&pr, text->data, n1, &l1);
+    uint8_t *b = compress_with(&pr, random->data, n2, &l2);
+    uint8_t *c = compress_with(&pr, text->data + n1, n3, &l3);
+    uint8_t *ab = append_blocks(a, l1, b, l2, &l12);
+    uint8_t *abc = append_blocks(ab, l12, c, l3, &l123);
+
+    uint8_t *want = (uint8_t*)malloc(n1 + n2 + n3);
+    memcpy(want, text->data, n1);
+    memcpy(want + n1, random->data, n2);
+    memcpy(want + n1 + n2, text->data + n1, n3);
+    uint8_t *out = (uint8_t*)malloc(n1 + n2 + n3);
+    size_t ol;
+    uint64_t size;
+    CHECK(huff_decompressed_size(abc, l123, &size) == HUF_OK && size == n1 + n2 + n3, "appended size");
+    int err = huff_decompress(abc, l123, out, n1 + n2 + n3, &ol);
+    CHECK(err == HUF_OK && ol == n1 + n2 + n3 && memcmp(out, want, ol) == 0,
+          "appended round trip: %s", huff_error_string(err));
+    HuffDCtx *d = huff_dctx_create();
+    err = huff_decompress_range(d, abc, l123, n1 - 100, out, n2 + 200, &ol);
+    CHECK(err == HUF_OK && ol == n2 + 200 && memcmp(out, want + n1 - 100, ol) == 0,
+          "range across appended blocks: %s", huff_error_string(err));
+    huff_dctx_free(d);
+
+    /* an appended archive joined with another walks every sequence */
+    uint8_t *joined = (uint8_t*)malloc(l12 + l3);
+    memcpy(joined, ab, l12);
+    memcpy(joined + l12, c, l3);
+    CHECK(huff_decompressed_size(joined, l12 + l3, &size) == HUF_OK && size == n1 + n2 + n3,
+          "appended and joined size");
+    err = huff_decompress(joined, l12 + l3, out, n1 + n2 + n3, &ol);
+    CHECK(err == HUF_OK && ol == n1 + n2 + n3 && memcmp(out, want, ol) == 0,
+          "appended and joined round trip: %s", huff_error_string(err));
+
+    /* cut off at the new blocks, or with the old index damaged */
+    CHECK(huff_decompress(abc, l12 + 100, out, n1 + n2 + n3, &ol) < 0, "appended and truncated");
+    abc[l1 - TRAILER_SIZE - 3] ^= 1;
+    CHECK(huff_decompress(abc, l123, out, n1 + n2 + n3, &ol) == HUF_ERR_CORRUPT, "old index damaged");
+
+    free(joined);
+    free(out);
+    free(want);
+    free(abc);
+    free(ab);
+    free(c);
+    free(b);
+    free(a);
+}
+
+int main(void) {
+    static const char *const names[] = { "text", "random", "one-byte", "runs", "repeats", "markov", "mixed" };
+    enum { NSAMPLES = sizeof(names) / sizeof(names[0]) };
+    Sample s[NSAMPLES + 2];
+    for (int i = 0; i < NSAMPLES; ++i) {
+        s[i].name = names[i];
+        s[i].size = 80000;
+        s[i].data = (uint8_t*)malloc(s[i].size);
+        fill(names[i], s[i].data, s[i].size);
+    }
+    /* the empty input and one byte */
+    s[NSAMPLES].name = "empty";
+    s[NSAMPLES].size = 0;
+    s[NSAMPLES].data = (uint8_t*)malloc(1);
+    s[NSAMPLES + 1].name = "single";
+    s[NSAMPLES + 1].size = 1;
+    s[NSAMPLES + 1].data = (uint8_t*)malloc(1);
+    s[NSAMPLES + 1].data[0] = 7;
+
+    test_roundtrips(s, NSAMPLES + 2);
+    test_dictionary(&s[0]);
+    test_errors(&s[0]);
+    test_concatenated(&s[0], &s[1]);
+    test_appended(&s[0], &s[1]);
+
+    for (int i = 0; i < NSAMPLES + 2; ++i) free(s[i].data);
+    if (failures) {
+        fprintf(stderr, "test_libhuff: %d failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("test_libhuff: ok\n");
+    return EXIT_SUCCESS;
+}